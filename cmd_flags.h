@@ -38,6 +38,9 @@
 #define H_FMATCH        0x04000u
 #define H_AUTOSTART     0x08000u
 #define H_SMALL_CNTRLS  0x10000u
+#define H_ASFILE        0x20000u
+#define H_PROGRESSIVE   0x40000u
+#define H_STDIN         0x80000u
 
 #define INF_LOOPS 0x7fffffff
 
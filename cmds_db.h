@@ -0,0 +1,224 @@
+/**
+ * This file is part of mozplugger a fork of plugger, for list of developers
+ * see the README file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+#ifndef _MOZPLUGGER_CMDS_DB_H_
+#define _MOZPLUGGER_CMDS_DB_H_
+
+/**
+ * Layout of the binary commands database (CMDS_DB_FILE) written by
+ * mozplugger-update and mapped read-only by mozplugger.so.
+ *
+ * The file holds one section per plugin group (cfgIdx), every patched copy
+ * of mozplugger.so maps the same file read-only so there is only one copy of
+ * the config in memory however many plugin groups the browser loads. The
+ * file starts with the db_set_header_t that gives where each section is.
+ *
+ * Each section is a position independent image, every reference is stored
+ * as an offset relative to the address of the reference itself (zero
+ * meaning NULL). This allows the same records to be used in place whether
+ * they were mapped from the file or built in memory from the text N.cmds
+ * file.
+ *
+ * A section is laid out as header, handler table, mimetype table, command
+ * table and finally the string table. All records are 8 byte aligned.
+ *
+ * The match keys are normalised by mozplugger-update so matching is simple
+ * integer and memory compares. Mimetypes are in lower case and hashed,
+ * fmatch patterns are split into kind and pattern, and each command has a
+ * mask of the contexts (see DB_CTX_xxx) in which it can be used.
+ */
+
+#define CMDS_DB_FILE "mozplugger.cmdb"
+#define CMDS_DB_SET_MAGIC "MPCMDS\n"
+#define CMDS_DB_MAGIC "MPCMDB\n"
+#define CMDS_DB_FORMAT (3)
+#define CMDS_DB_ALIGN(x) (((x) + 7) & ~7)
+
+typedef int64_t db_ref_t;
+
+struct db_section_s
+{
+     uint64_t offset;          /**< Offset of section from start of file */
+     uint64_t size;            /**< Size of the section, zero if none */
+};
+
+typedef struct db_section_s db_section_t;
+
+struct db_set_header_s
+{
+     char magic[8];
+     uint32_t format;
+     uint32_t numSections;
+     uint64_t size;            /**< Total size of the file in bytes */
+     /* Followed by numSections db_section_t indexed by cfgIdx */
+};
+
+typedef struct db_set_header_s db_set_header_t;
+
+struct db_header_s
+{
+     char magic[8];
+     uint32_t format;
+     uint32_t size;            /**< Total size of the image in bytes */
+     char version[16];         /**< VERSION of mozplugger-update */
+     uint32_t numHandlers;
+     uint32_t numTypes;
+     uint32_t numCmds;
+     uint32_t stringsLen;
+     db_ref_t handlers;        /**< Array of numHandlers db_handler_t */
+     db_ref_t strings;         /**< Start of the string table */
+};
+
+typedef struct db_header_s db_header_t;
+
+/**
+ * Hash of the (lower case) mimetypes, FNV-1a
+ */
+#define DB_HASH_INIT (2166136261u)
+#define DB_HASH_STEP(hash, c) (((hash) ^ (unsigned char) (c)) * 16777619u)
+
+#define DB_MIMETYPE_ANY (1)    /**< The '*' mimetype that matches all */
+
+struct db_mimetype_s
+{
+     db_ref_t type;            /**< In lower case */
+     uint32_t hash;            /**< Hash of type */
+     uint16_t len;             /**< Length of type */
+     uint16_t flags;
+};
+
+typedef struct db_mimetype_s db_mimetype_t;
+
+/**
+ * The context a command is being looked up for, a command can be used if
+ * the bit DB_CTX_BIT(context) is set in its accept mask
+ */
+#define DB_CTX_EMBED   (0x01)  /**< Mode is H_EMBED */
+#define DB_CTX_NOEMBED (0x02)  /**< Mode is H_NOEMBED */
+#define DB_CTX_LINKS   (0x04)  /**< Mode is H_LINKS */
+#define DB_CTX_LOOP    (0x08)  /**< Looping forever */
+#define DB_CTX_STREAM  (0x10)  /**< Only stream commands */
+#define DB_NUM_CTX     (32)
+#define DB_CTX_BIT(ctx) (1u << (ctx))
+
+#define DB_FMATCH_NONE   (0)
+#define DB_FMATCH_PREFIX (1)   /**< '*' URL starts with (any case) */
+#define DB_FMATCH_SUFFIX (2)   /**< '%' URL path ends with (any case) */
+#define DB_FMATCH_SUBSTR (3)   /**< URL contains */
+
+struct db_command_s
+{
+     uint32_t flags;
+     uint32_t accept;          /**< Mask of DB_CTX_BIT() */
+     db_ref_t cmd;
+     db_ref_t winname;
+     db_ref_t fmatchStr;       /**< Pattern without the '*' or '%' */
+     uint32_t fmatchKind;      /**< DB_FMATCH_xxx */
+     uint32_t fmatchLen;       /**< Length of fmatchStr */
+};
+
+typedef struct db_command_s db_command_t;
+
+struct db_handler_s
+{
+     db_ref_t types;           /**< Array of numTypes db_mimetype_t */
+     db_ref_t cmds;            /**< Array of numCmds db_command_t */
+     uint32_t numTypes;
+     uint32_t numCmds;
+};
+
+typedef struct db_handler_s db_handler_t;
+
+/**
+ * Layout of the manifest (MANIFEST_FILE) written by mozplugger-update. It
+ * holds all that mozplugger.so needs before a plugin instance is created,
+ * the description, name and version of every plugin group and the paths of
+ * the helpers, together with the details of the inputs it was generated
+ * from. The inputs are the mozpluggerrc files and every directory that was
+ * searched for the config, helpers and applications (as installing or
+ * removing a program changes the directory), so checking the cache is up
+ * to date takes one stat() of each input and nothing else has to be read.
+ * Like the commands database it is mapped read-only and used in place.
+ *
+ * Also recorded for each plugin group is a digest of what was written for
+ * it, so that when an input changes mozplugger-update can tell which groups
+ * are affected and leave the files of the others alone (keeping the plugin
+ * mtimes the browser uses to decide whether to rescan its plugins).
+ */
+#define MANIFEST_FILE "mozplugger.manifest"
+#define MANIFEST_MAGIC "MPMANI\n"
+#define MANIFEST_FORMAT (3)
+
+#define MANIFEST_SRC_MISSING (1) /**< Input did not exist */
+
+struct manifest_source_s
+{
+     db_ref_t path;
+     uint64_t dev;
+     uint64_t ino;
+     int64_t mtime;
+     uint64_t size;
+     uint32_t flags;
+     uint32_t reserved;
+};
+
+typedef struct manifest_source_s manifest_source_t;
+
+struct manifest_plugin_s
+{
+     db_ref_t name;
+     db_ref_t version;
+     db_ref_t mimetypes;       /**< Description for NP_GetMIMEDescription() */
+     uint64_t digest;          /**< Digest of the files written for the group */
+};
+
+typedef struct manifest_plugin_s manifest_plugin_t;
+
+struct manifest_header_s
+{
+     char magic[8];
+     uint32_t format;
+     uint32_t size;            /**< Total size of the manifest in bytes */
+     char version[16];         /**< VERSION of mozplugger-update */
+     int64_t updated;          /**< When mozplugger-update ran */
+     db_ref_t linker;
+     db_ref_t controller;
+     db_ref_t helper;
+     db_ref_t sources;         /**< Array of numSources manifest_source_t */
+     db_ref_t plugins;         /**< Array of manifest_plugin_t by cfgIdx */
+     uint32_t numSources;
+     uint32_t numPlugins;
+};
+
+typedef struct manifest_header_s manifest_header_t;
+
+/**
+ * Follow a reference, the argument must be the reference field itself
+ * (not a copy of it) as the offset is relative to its address.
+ */
+#define DB_DEREF(ref) \
+     ((ref) ? (const void *)((const char *) &(ref) + (ref)) : (const void *) 0)
+
+/**
+ * Point a reference at a target, target may be NULL.
+ */
+#define DB_SETREF(ref, target) \
+     ((ref) = (target) ? (db_ref_t)((const char *)(target) - (const char *) &(ref)) : 0)
+
+#endif
@@ -0,0 +1,661 @@
+/**
+ * This file is part of mozplugger a fork of plugger, for list of developers
+ * see the README file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <ctype.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "m4_expand.h"
+
+/**
+ * The expander follows the way GNU m4 scans its input. Quoted strings lose
+ * one level of quotes, '#' comments are copied as is and a word that names
+ * a macro is replaced by its expansion which is then scanned again. The
+ * arguments of a macro are expanded as they are collected. Anything outside
+ * of this subset (any other m4 builtin, $* or $@ etc) makes the expansion
+ * fail so that the caller can run the real m4 instead.
+ */
+
+#define M4_MAX_ARGS (9)
+#define M4_MAX_QUOTE_LEN (5)
+#define M4_MAX_EXPANSIONS (100000) /* Guard against recursive macros */
+#define M4_MAX_NESTING (256)      /* Macro calls within arguments */
+#define M4_PUSHBACK_ROOM (4096)
+
+struct m4Buf_s
+{
+     char * buf;
+     size_t len;
+     size_t size;
+};
+
+typedef struct m4Buf_s m4Buf_t;
+
+struct m4Macro_s
+{
+     char * name;
+     char * body;
+     struct m4Macro_s * pNext;
+};
+
+typedef struct m4Macro_s m4Macro_t;
+
+struct m4State_s
+{
+     char * in;                /**< Unread input is in[pos] to in[len-1] */
+     size_t pos;
+     size_t len;
+     char lquote[M4_MAX_QUOTE_LEN + 1];
+     char rquote[M4_MAX_QUOTE_LEN + 1];
+     m4Macro_t * macros;
+     unsigned expansions;
+     unsigned nesting;
+};
+
+typedef struct m4State_s m4State_t;
+
+struct m4Builtin_s
+{
+     const char * name;
+     bool needsArgs;           /**< Only recognised when followed by '(' */
+};
+
+typedef struct m4Builtin_s m4Builtin_t;
+
+/* The GNU m4 builtins that are not supported */
+static const m4Builtin_t g_unsupported[] =
+{
+     {"__file__", false}, {"__gnu__", false}, {"__line__", false},
+     {"__os2__", false}, {"__program__", false}, {"__unix__", false},
+     {"__windows__", false}, {"builtin", true}, {"changecom", false},
+     {"changeword", true}, {"debugfile", false}, {"debugmode", false},
+     {"decr", true}, {"defn", true}, {"divert", false}, {"divnum", false},
+     {"dumpdef", false}, {"errprint", true}, {"esyscmd", true},
+     {"eval", true}, {"format", true}, {"ifdef", true}, {"ifelse", true},
+     {"include", true}, {"incr", true}, {"index", true}, {"indir", true},
+     {"len", true}, {"m4exit", false}, {"m4wrap", true}, {"maketemp", true},
+     {"mkstemp", true}, {"patsubst", true}, {"popdef", true},
+     {"pushdef", true}, {"regexp", true}, {"shift", true},
+     {"sinclude", true}, {"substr", true}, {"syscmd", true},
+     {"sysval", false}, {"traceoff", false}, {"traceon", false},
+     {"translit", true}, {"undefine", true}, {"undivert", false}
+};
+
+static bool expand_token(m4State_t * st, m4Buf_t * out);
+
+/**
+ * Append text to a buffer, the buffer is always kept null terminated
+ *
+ * @param[in,out] b The buffer
+ * @param[in] text The text to append
+ * @param[in] len The length of the text
+ *
+ * @return false if out of memory
+ */
+static bool buf_append(m4Buf_t * b, const char * text, size_t len)
+{
+     if(b->len + len + 1 > b->size)
+     {
+          const size_t size = 2 * (b->len + len + 1) + 64;
+          char * buf = realloc(b->buf, size);
+          if(!buf)
+          {
+               return false;
+          }
+          b->buf = buf;
+          b->size = size;
+     }
+     memcpy(&b->buf[b->len], text, len);
+     b->len += len;
+     b->buf[b->len] = '\0';
+     return true;
+}
+
+/**
+ * Push text back onto the input so it is read next
+ *
+ * @param[in,out] st The expander state
+ * @param[in] text The text, must not point into the input
+ * @param[in] len The length of the text
+ *
+ * @return false if out of memory
+ */
+static bool push_back(m4State_t * st, const char * text, size_t len)
+{
+     if(len > st->pos)
+     {
+          const size_t rest = st->len - st->pos;
+          const size_t room = len + M4_PUSHBACK_ROOM;
+          char * in = malloc(room + rest + 1);
+
+          if(!in)
+          {
+               return false;
+          }
+          memcpy(&in[room], &st->in[st->pos], rest + 1);
+          free(st->in);
+          st->in = in;
+          st->pos = room;
+          st->len = room + rest;
+     }
+     st->pos -= len;
+     memcpy(&st->in[st->pos], text, len);
+     return true;
+}
+
+/**
+ * Check if the unread input starts with a string
+ *
+ * @param[in] st The expander state
+ * @param[in] str The string
+ *
+ * @return true if it does
+ */
+static bool next_is(const m4State_t * st, const char * str)
+{
+     const size_t len = strlen(str);
+     return (len <= st->len - st->pos) && (memcmp(&st->in[st->pos], str, len) == 0);
+}
+
+/**
+ * Check if a character can start a macro name
+ */
+static bool is_word_start(char c)
+{
+     return isalpha((unsigned char) c) || (c == '_');
+}
+
+/**
+ * Check if a character can be part of a macro name
+ */
+static bool is_word_char(char c)
+{
+     return isalnum((unsigned char) c) || (c == '_');
+}
+
+/**
+ * Find a macro defined by the input
+ *
+ * @param[in] st The expander state
+ * @param[in] name The name, not null terminated
+ * @param[in] len The length of the name
+ *
+ * @return The macro or NULL
+ */
+static m4Macro_t * find_macro(const m4State_t * st, const char * name, size_t len)
+{
+     m4Macro_t * macro;
+
+     for(macro = st->macros; macro; macro = macro->pNext)
+     {
+          if((strncmp(macro->name, name, len) == 0) && (macro->name[len] == '\0'))
+          {
+               return macro;
+          }
+     }
+     return NULL;
+}
+
+/**
+ * Check if a word is a call of a builtin of m4 that is not supported
+ *
+ * @param[in] st The expander state, input is just after the word
+ * @param[in] name The name, not null terminated
+ * @param[in] len The length of the name
+ *
+ * @return true if it is
+ */
+static bool is_unsupported(const m4State_t * st, const char * name, size_t len)
+{
+     int i;
+
+     for(i = 0; i < sizeof(g_unsupported)/sizeof(m4Builtin_t); i++)
+     {
+          const m4Builtin_t * builtin = &g_unsupported[i];
+          if((strncmp(builtin->name, name, len) == 0) && (builtin->name[len] == '\0'))
+          {
+               return !builtin->needsArgs || next_is(st, "(");
+          }
+     }
+     return false;
+}
+
+/**
+ * Read a quoted string, adding it without the outer quotes to the output
+ *
+ * @param[in,out] st The expander state, input is at the opening quote
+ * @param[in,out] out The output
+ *
+ * @return false if there is no closing quote
+ */
+static bool read_quoted(m4State_t * st, m4Buf_t * out)
+{
+     const size_t lqLen = strlen(st->lquote);
+     const size_t rqLen = strlen(st->rquote);
+     int depth = 1;
+     size_t start;
+
+     st->pos += lqLen;
+     start = st->pos;
+     while(st->pos < st->len)
+     {
+          if(next_is(st, st->rquote))
+          {
+               if(--depth == 0)
+               {
+                    const bool ok = buf_append(out, &st->in[start], st->pos - start);
+                    st->pos += rqLen;
+                    return ok;
+               }
+               st->pos += rqLen;
+          }
+          else if(next_is(st, st->lquote))
+          {
+               depth++;
+               st->pos += lqLen;
+          }
+          else
+          {
+               st->pos++;
+          }
+     }
+     return false;
+}
+
+/**
+ * Collect the arguments of a macro call, each argument is expanded as it is
+ * collected and unquoted white space at the start of an argument is dropped.
+ *
+ * @param[in,out] st The expander state, input is at the '('
+ * @param[out] args The arguments
+ * @param[out] pNumArgs The number of arguments
+ *
+ * @return false if the arguments could not be collected
+ */
+static bool collect_args(m4State_t * st, m4Buf_t * args, int * pNumArgs)
+{
+     int numArgs = 0;
+
+     st->pos++;
+     for(;;)
+     {
+          m4Buf_t * arg = &args[numArgs];
+          int depth = 0;
+
+          if(numArgs >= M4_MAX_ARGS)
+          {
+               return false;
+          }
+          numArgs++;
+          *pNumArgs = numArgs;
+          if(!buf_append(arg, "", 0))
+          {
+               return false;
+          }
+
+          while((st->pos < st->len) && isspace((unsigned char) st->in[st->pos]))
+          {
+               st->pos++;
+          }
+
+          for(;;)
+          {
+               char c;
+
+               if(st->pos >= st->len)
+               {
+                    return false;
+               }
+               c = st->in[st->pos];
+               if(next_is(st, st->lquote) || (c == '#') || is_word_start(c))
+               {
+                    if(!expand_token(st, arg))
+                    {
+                         return false;
+                    }
+                    continue;
+               }
+               if(depth == 0)
+               {
+                    if(c == ',')
+                    {
+                         st->pos++;
+                         break;
+                    }
+                    if(c == ')')
+                    {
+                         st->pos++;
+                         return true;
+                    }
+               }
+               if(c == '(')
+               {
+                    depth++;
+               }
+               else if(c == ')')
+               {
+                    depth--;
+               }
+               if(!buf_append(arg, &c, 1))
+               {
+                    return false;
+               }
+               st->pos++;
+          }
+     }
+}
+
+/**
+ * Work out the expansion of a macro defined by the input and push it back
+ * onto the input to be scanned again
+ *
+ * @param[in,out] st The expander state
+ * @param[in] macro The macro
+ * @param[in] args The arguments
+ * @param[in] numArgs The number of arguments
+ *
+ * @return false if the body uses something not supported
+ */
+static bool call_macro(m4State_t * st, const m4Macro_t * macro,
+                                              const m4Buf_t * args, int numArgs)
+{
+     m4Buf_t exp = {NULL, 0, 0};
+     const char * p;
+     bool ok = buf_append(&exp, "", 0);
+
+     for(p = macro->body; ok && *p; p++)
+     {
+          if((p[0] == '$') && isdigit((unsigned char) p[1]))
+          {
+               const int n = p[1] - '0';
+
+               /* GNU m4 reads $10 as the tenth argument, others as $1 0 */
+               if(isdigit((unsigned char) p[2]))
+               {
+                    ok = false;
+               }
+               else if(n == 0)
+               {
+                    ok = buf_append(&exp, macro->name, strlen(macro->name));
+               }
+               else if(n <= numArgs)
+               {
+                    ok = buf_append(&exp, args[n-1].buf, args[n-1].len);
+               }
+               p++;
+          }
+          else if((p[0] == '$') && (p[1] == '#'))
+          {
+               const char num = '0' + numArgs;
+               ok = buf_append(&exp, &num, 1);
+               p++;
+          }
+          else if((p[0] == '$') && ((p[1] == '*') || (p[1] == '@')))
+          {
+               ok = false;
+          }
+          else
+          {
+               ok = buf_append(&exp, p, 1);
+          }
+     }
+
+     ok = ok && push_back(st, exp.buf, exp.len);
+     free(exp.buf);
+     return ok;
+}
+
+/**
+ * Define a macro, replacing any existing definition
+ *
+ * @param[in,out] st The expander state
+ * @param[in] args The arguments of define
+ * @param[in] numArgs The number of arguments
+ *
+ * @return false if out of memory
+ */
+static bool define_macro(m4State_t * st, const m4Buf_t * args, int numArgs)
+{
+     const char * body = (numArgs > 1) ? args[1].buf : "";
+     m4Macro_t * macro = find_macro(st, args[0].buf, args[0].len);
+
+     if(!macro)
+     {
+          if(!(macro = calloc(1, sizeof(m4Macro_t))))
+          {
+               return false;
+          }
+          if(!(macro->name = strdup(args[0].buf)))
+          {
+               free(macro);
+               return false;
+          }
+          macro->pNext = st->macros;
+          st->macros = macro;
+     }
+     free(macro->body);
+     return (macro->body = strdup(body)) != NULL;
+}
+
+/**
+ * Change the quotes, only changing both to non empty strings is supported
+ *
+ * @param[in,out] st The expander state
+ * @param[in] args The arguments of changequote
+ * @param[in] numArgs The number of arguments
+ *
+ * @return false if not supported
+ */
+static bool change_quotes(m4State_t * st, const m4Buf_t * args, int numArgs)
+{
+     if((numArgs != 2) || (args[0].len == 0) || (args[1].len == 0) ||
+        (args[0].len > M4_MAX_QUOTE_LEN) || (args[1].len > M4_MAX_QUOTE_LEN))
+     {
+          return false;
+     }
+     strcpy(st->lquote, args[0].buf);
+     strcpy(st->rquote, args[1].buf);
+     return true;
+}
+
+/**
+ * Check if a word is a particular name
+ */
+static bool is_name(const char * word, size_t len, const char * name)
+{
+     return (strncmp(word, name, len) == 0) && (name[len] == '\0');
+}
+
+/**
+ * Handle a word, if it names a macro it is expanded otherwise it is added
+ * to the output as is
+ *
+ * @param[in,out] st The expander state, input is at the word
+ * @param[in,out] out The output
+ *
+ * @return false if the expansion failed
+ */
+static bool expand_word(m4State_t * st, m4Buf_t * out)
+{
+     m4Buf_t args[M4_MAX_ARGS];
+     const char * name = &st->in[st->pos];
+     size_t len = 1;
+     int numArgs = 0;
+     m4Macro_t * macro;
+     bool isDefine;
+     bool ok = true;
+     int i;
+
+     while((st->pos + len < st->len) && is_word_char(name[len]))
+     {
+          len++;
+     }
+     st->pos += len;
+
+     /* A macro defined by the input takes precedence over a builtin */
+     macro = find_macro(st, name, len);
+     isDefine = !macro && is_name(name, len, "define");
+     if(!macro && is_name(name, len, "dnl"))
+     {
+          if(next_is(st, "("))
+          {
+               return false;
+          }
+          while((st->pos < st->len) && (st->in[st->pos++] != '\n'))
+          {
+          }
+          return true;
+     }
+     if(!macro && !isDefine && !is_name(name, len, "changequote"))
+     {
+          return !is_unsupported(st, name, len) && buf_append(out, name, len);
+     }
+     if(!macro && !next_is(st, "("))
+     {
+          /* define is only recognised with arguments, changequote without
+           * arguments restores the default quotes */
+          if(isDefine)
+          {
+               return buf_append(out, name, len);
+          }
+          strcpy(st->lquote, "`");
+          strcpy(st->rquote, "'");
+          return true;
+     }
+
+     if(++st->expansions > M4_MAX_EXPANSIONS)
+     {
+          return false;
+     }
+
+     memset(args, 0, sizeof(args));
+     if(next_is(st, "("))
+     {
+          ok = (++st->nesting <= M4_MAX_NESTING) && collect_args(st, args, &numArgs);
+          st->nesting--;
+     }
+
+     if(ok)
+     {
+          if(macro)
+          {
+               ok = call_macro(st, macro, args, numArgs);
+          }
+          else if(isDefine)
+          {
+               ok = (args[0].len > 0) && define_macro(st, args, numArgs);
+          }
+          else
+          {
+               ok = change_quotes(st, args, numArgs);
+          }
+     }
+
+     for(i = 0; i < M4_MAX_ARGS; i++)
+     {
+          free(args[i].buf);
+     }
+     return ok;
+}
+
+/**
+ * Process the next token of the input
+ *
+ * @param[in,out] st The expander state
+ * @param[in,out] out The output
+ *
+ * @return false if the expansion failed
+ */
+static bool expand_token(m4State_t * st, m4Buf_t * out)
+{
+     const char c = st->in[st->pos];
+
+     if(next_is(st, st->lquote))
+     {
+          return read_quoted(st, out);
+     }
+     if(c == '#')
+     {
+          const size_t start = st->pos;
+          while((st->pos < st->len) && (st->in[st->pos++] != '\n'))
+          {
+          }
+          return buf_append(out, &st->in[start], st->pos - start);
+     }
+     if(is_word_start(c))
+     {
+          return expand_word(st, out);
+     }
+     st->pos++;
+     return buf_append(out, &c, 1);
+}
+
+/**
+ * Expand the subset of m4 used by mozpluggerrc
+ *
+ * @param[in] input The text to expand
+ * @param[in] len The length of the text
+ *
+ * @return allocated null terminated expansion or NULL if the input uses
+ *         something that is not supported (or is in error)
+ */
+char * m4_expand(const char * input, size_t len)
+{
+     m4State_t st;
+     m4Buf_t out = {NULL, 0, 0};
+     bool ok;
+
+     memset(&st, 0, sizeof(st));
+     strcpy(st.lquote, "`");
+     strcpy(st.rquote, "'");
+     if(!(st.in = malloc(len + 1)))
+     {
+          return NULL;
+     }
+     memcpy(st.in, input, len);
+     st.in[len] = '\0';
+     st.len = len;
+
+     ok = buf_append(&out, "", 0);
+     while(ok && (st.pos < st.len))
+     {
+          ok = expand_token(&st, &out);
+     }
+
+     free(st.in);
+     while(st.macros)
+     {
+          m4Macro_t * macro = st.macros;
+          st.macros = macro->pNext;
+          free(macro->name);
+          free(macro->body);
+          free(macro);
+     }
+     if(!ok)
+     {
+          free(out.buf);
+          return NULL;
+     }
+     return out.buf;
+}
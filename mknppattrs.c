@@ -0,0 +1,165 @@
+/**
+ * This file is part of mozplugger a fork of plugger, for list of developers
+ * see the README file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+/**
+ * Build time generator of the perfect hash table used by NPP_New() to
+ * dispatch on the tag attribute names listed in npp_attrs.h. Searches for
+ * the smallest power of two table size, and a seed for that size, for which
+ * no two names hash to the same slot and writes the table as a C header to
+ * stdout.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "npp_attrs.h"
+
+#define MAX_TABLE_SIZE (4096)
+#define MAX_SEEDS (100000)
+
+struct attr_s
+{
+     const char * name;
+     const char * id;
+};
+
+typedef struct attr_s attr_t;
+
+#define NPP_ATTR(id, name) { name, "NPP_ATTR_" #id },
+static const attr_t g_attrs[NUM_NPP_ATTRS] =
+{
+     NPP_ATTR_LIST
+};
+#undef NPP_ATTR
+
+/**
+ * Hash an attribute name the same way as the plugin does.
+ *
+ * @param[in] seed The starting value of the hash
+ * @param[in] name The attribute name
+ *
+ * @return The hash value
+ */
+static uint32_t hash_attr(uint32_t seed, const char * name)
+{
+     uint32_t hash = seed;
+
+     for(; *name; name++)
+     {
+          hash = NPP_ATTR_HASH_STEP(hash, *name);
+     }
+     return hash;
+}
+
+/**
+ * Try to place all the attributes in a table with the given size and seed.
+ *
+ * @param[in] seed The seed of the hash
+ * @param[in] mask The table size minus one
+ * @param[out] slots Filled with the index in g_attrs of each slot's attribute
+ *                   or -1 if empty
+ *
+ * @return 1(true) if there were no collisions, zero otherwise
+ */
+static int try_seed(uint32_t seed, int mask, int * slots)
+{
+     int i;
+
+     for(i = 0; i <= mask; i++)
+     {
+          slots[i] = -1;
+     }
+     for(i = 0; i < NUM_NPP_ATTRS; i++)
+     {
+          const uint32_t slot = NPP_ATTR_SLOT(hash_attr(seed, g_attrs[i].name),
+                                                                        mask);
+          if(slots[slot] >= 0)
+          {
+               return 0;
+          }
+          slots[slot] = i;
+     }
+     return 1;
+}
+
+/**
+ * Write the table as a C header.
+ *
+ * @param[in] seed The seed of the hash
+ * @param[in] mask The table size minus one
+ * @param[in] slots The index in g_attrs of each slot's attribute or -1
+ */
+static void write_table(uint32_t seed, int mask, const int * slots)
+{
+     int i;
+
+     printf("/* Generated by mknppattrs from npp_attrs.h, do not edit */\n\n");
+     printf("#define NPP_ATTR_SEED (0x%08xu)\n", seed);
+     printf("#define NPP_ATTR_MASK (%d)\n\n", mask);
+     printf("static const npp_attr_slot_t g_nppAttrSlots[NPP_ATTR_MASK + 1] =\n");
+     printf("{\n");
+     for(i = 0; i <= mask; i++)
+     {
+          if(slots[i] >= 0)
+          {
+               printf("     { \"%s\", %s },\n", g_attrs[slots[i]].name,
+                                                        g_attrs[slots[i]].id);
+          }
+          else
+          {
+               printf("     { NULL, NPP_ATTR_NONE },\n");
+          }
+     }
+     printf("};\n");
+}
+
+/**
+ * main() - Find a collision free seed, trying bigger tables if needed.
+ *
+ * @return EXIT_SUCCESS or EXIT_FAILURE if no perfect hash was found
+ */
+int main(void)
+{
+     static int slots[MAX_TABLE_SIZE];
+     int size = 1;
+     uint32_t seed;
+
+     while(size < NUM_NPP_ATTRS)
+     {
+          size <<= 1;
+     }
+
+     for(; size <= MAX_TABLE_SIZE; size <<= 1)
+     {
+          for(seed = 2166136261u; seed < 2166136261u + MAX_SEEDS; seed++)
+          {
+               if(try_seed(seed, size - 1, slots))
+               {
+                    write_table(seed, size - 1, slots);
+                    return EXIT_SUCCESS;
+               }
+          }
+     }
+
+     fprintf(stderr, "mknppattrs: no perfect hash found\n");
+     return EXIT_FAILURE;
+}
@@ -21,6 +21,8 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE /* for memmem() and copy_file_range() */
+
 #include <unistd.h>
 #include <ctype.h>      /* For isalnum() */
 #include <string.h>
@@ -32,7 +34,11 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <time.h>
+#include <dirent.h>
+#include <sys/mman.h>
 
 #ifdef HAVE_GETPWUID
 #include <pwd.h> /* For alternative way to find HOME dir */
@@ -40,9 +46,15 @@
 
 #include "cmd_flags.h"
 #include "plugin_name.h"
+#include "cmds_db.h"
+#include "m4_expand.h"
 
 #define MAX_CONFIG_LINE_LEN (256)
 #define MAX_FILE_PATH_LEN (512)
+#define APP_CACHE_SIZE (256)      /* Must be a power of 2 */
+#define PATH_INDEX_SIZE (4096)    /* Must be a power of 2 */
+#define PATH_CACHE_FILE "mozplugger.path"
+#define CORE_FILE "mozplugger-core.so"
 
 #define DEF_PLUGIN "[MozPlugger base Plugin]"
 
@@ -102,7 +114,7 @@ struct pluginType_s
 typedef struct pluginType_s pluginType_t;
 
 /**
- * Linked list of applications that have been tested
+ * Hash table of applications that have been tested
  */
 
 struct appCacheEntry_s
@@ -115,6 +127,21 @@ struct appCacheEntry_s
 
 typedef struct appCacheEntry_s appCacheEntry_t;
 
+/**
+ * Hash table of the files in the PATH directories, there is an entry for
+ * each directory a name is in, the entries for a name are in PATH order.
+ */
+
+struct pathEntry_s
+{
+     const char * name;        /* Follows the entry in the same allocation */
+     int dirIdx;               /* Index into g_pathDirs */
+
+     struct pathEntry_s * pNext;
+};
+
+typedef struct pathEntry_s pathEntry_t;
+
 /**
  * List of possible places to look for apps and config
  */
@@ -137,12 +164,105 @@ struct browser_s
 
 typedef struct browser_s browser_t;
 
+/**
+ * Buffer used whilst building the binary commands database image, all
+ * positions are held as offsets as the buffer may move when it grows.
+ */
+struct dbImage_s
+{
+     char * buf;
+     size_t len;
+     size_t size;
+     size_t * strTable;        /**< Hash table of offsets of strings added */
+     size_t strTableMask;
+};
+
+typedef struct dbImage_s dbImage_t;
+
+/**
+ * What is recorded in the manifest about each plugin group
+ */
+struct manifestPlugin_s
+{
+     char * name;
+     char * version;
+     char * mimetypes;
+     uint64_t digest;
+};
+
+typedef struct manifestPlugin_s manifestPlugin_t;
+
+/**
+ * What is recorded in the manifest about each mozpluggerrc read
+ */
+struct manifestSource_s
+{
+     char * path;
+     bool exists;
+     struct stat details;
+};
+
+typedef struct manifestSource_s manifestSource_t;
+
+/**
+ * A mozpluggerrc that has been read, the browsers usually share the one
+ * file so it is only read once however many browsers use it
+ */
+struct parsedConfig_s
+{
+     dev_t dev;
+     ino_t ino;
+     pluginType_t * plugins;   /* As trimmed by trim() */
+};
+
+typedef struct parsedConfig_s parsedConfig_t;
+
 /**
  * Global variables
  */
 
-static appCacheEntry_t * g_cache = NULL;
+static appCacheEntry_t * g_cache[APP_CACHE_SIZE];
+static pathEntry_t * g_pathIndex[PATH_INDEX_SIZE];
+static char ** g_pathDirs = NULL;
+static int g_numPathDirs = 0;
+static bool g_indexedPath = false;
 static bool g_verbose = false;
+static dbImage_t * g_dbSections = NULL; /**< Indexed by cfgIdx */
+static int g_numDbSections = 0;
+static manifestPlugin_t * g_manifestPlugins = NULL; /**< Indexed by cfgIdx */
+static int g_numManifestPlugins = 0;
+static manifestSource_t * g_manifestSources = NULL;
+static int g_numManifestSources = 0;
+static parsedConfig_t * g_parsedConfigs = NULL;
+static int g_numParsedConfigs = 0;
+
+static const char * g_helperNames[] =
+{
+     "mozplugger-linker",
+     "mozplugger-helper",
+     "mozplugger-controller"
+};
+
+#define NUM_HELPERS (sizeof(g_helperNames)/sizeof(const char *))
+
+static char * g_helperPaths[NUM_HELPERS]; /**< As found by find_helpers() */
+static bool g_foundHelpers = false;
+
+/**
+ * Digest of the files written for a plugin group, FNV-1a 64 bit
+ */
+#define DIGEST_INIT (14695981039346656037ull)
+#define DIGEST_STEP(digest, c) (((digest) ^ (unsigned char) (c)) * 1099511628211ull)
+
+static manifest_header_t * g_prevManifest = NULL; /**< As left by last run */
+
+#ifndef READ_FROM_INT_BLOB
+/* Where the mozplugger.so that is copied for each plugin group is found */
+static const char g_globalPluginDirs[] = GLOBAL_PLUGIN_DIRS
+                    "/usr/lib/mozilla/plugins /usr/lib/netscape/plugins "
+                    "/usr/lib/firefox/plugins /usr/lib/chromium/plugins "
+                    "/usr/local/lib/browser_plugins/mozplugger";
+#endif
 
 
 #ifdef __GNUC__
@@ -254,6 +374,93 @@ static const char * get_home_dir(void)
 }
 
 
+/**
+ * Add some bytes to a digest
+ *
+ * @param[in] digest The digest so far
+ * @param[in] data The bytes
+ * @param[in] len The number of bytes
+ *
+ * @return The new digest
+ */
+static uint64_t digest_bytes(uint64_t digest, const void * data, size_t len)
+{
+     const unsigned char * p = data;
+
+     for(; len > 0; len--)
+     {
+          digest = DIGEST_STEP(digest, *p++);
+     }
+     return digest;
+}
+
+/**
+ * Add a string (including its terminator) to a digest
+ *
+ * @param[in] digest The digest so far
+ * @param[in] str The string, NULL is treated as empty
+ *
+ * @return The new digest
+ */
+static uint64_t digest_str(uint64_t digest, const char * str)
+{
+     return digest_bytes(digest, str ? str : "", str ? strlen(str) + 1 : 1);
+}
+
+/**
+ * Record an input for the manifest, the details are taken before the input
+ * is used so that if it changes whilst being used the manifest is seen as
+ * out of date. An input that does not exist is recorded as missing.
+ *
+ * @param[in] fname The path of the file or directory
+ */
+static void add_manifest_source(const char * fname)
+{
+     manifestSource_t * src;
+     int i;
+
+     for(i = 0; i < g_numManifestSources; i++)
+     {
+          if(strcmp(g_manifestSources[i].path, fname) == 0)
+          {
+               return;
+          }
+     }
+
+     if(!(g_manifestSources = realloc(g_manifestSources,
+                         (g_numManifestSources + 1) * sizeof(manifestSource_t))))
+     {
+          ERROR("malloc error\n");
+     }
+     src = &g_manifestSources[g_numManifestSources++];
+     if(!(src->path = strdup(fname)))
+     {
+          ERROR("malloc error\n");
+     }
+     src->exists = (stat(fname, &src->details) == 0);
+     if(!src->exists)
+     {
+          memset(&src->details, 0, sizeof(src->details));
+     }
+}
+
+/**
+ * Record the directory a file is in (or would be in) for the manifest
+ *
+ * @param[in] fname The path of the file
+ */
+static void add_manifest_dir_of(const char * fname)
+{
+     char dir[MAX_FILE_PATH_LEN];
+     const char * sep = strrchr(fname, '/');
+
+     if(sep && (sep != fname))
+     {
+          snprintf(dir, sizeof(dir), "%.*s", (int) (sep - fname), fname);
+          add_manifest_source(dir);
+     }
+}
+
 /**
  * Check the path exists and if so allocate memory to hold the path name
  *
@@ -264,6 +471,10 @@ static const char * get_home_dir(void)
 static char * chk_path_and_alloc(const char * fname)
 {
      struct stat buf;
+
+     /* A file appearing in a directory searched before where it was found
+      * changes the result */
+     add_manifest_dir_of(fname);
      if (stat(fname, &buf) != 0)
      {
 	  LOG_DEBUG("chk_path_and_alloc(%s) = no\n", fname);
@@ -333,9 +544,321 @@ static char * find_helper_file(const cfgPath_t * paths, const char * basename)
 }
 
 
+/**
+ * Hash a name for the application cache and PATH index
+ *
+ * @param[in] name The name
+ *
+ * @return The hash
+ */
+static uint32_t hash_name(const char * name)
+{
+     uint32_t hash = DB_HASH_INIT;
+
+     for(; *name; name++)
+     {
+          hash = DB_HASH_STEP(hash, *name);
+     }
+     return hash;
+}
+
+static char * get_cache_dir(void);
+
+/**
+ * Add a file in a PATH directory to the index
+ *
+ * @param[in] name The file name, not null terminated
+ * @param[in] len The length of the name
+ * @param[in] dirIdx Index of the directory in g_pathDirs
+ */
+static void add_path_entry(const char * name, size_t len, int dirIdx)
+{
+     pathEntry_t * entry;
+     pathEntry_t ** bucket;
+     char * copy;
+
+     if(!(entry = malloc(sizeof(pathEntry_t) + len + 1)))
+     {
+          ERROR("malloc error\n");
+     }
+     copy = (char *) &entry[1];
+     memcpy(copy, name, len);
+     copy[len] = '\0';
+     entry->name = copy;
+     entry->dirIdx = dirIdx;
+     bucket = &g_pathIndex[hash_name(copy) & (PATH_INDEX_SIZE - 1)];
+     entry->pNext = *bucket;
+     *bucket = entry;
+}
+
+/**
+ * Read the listings of the PATH directories saved by the previous run. The
+ * file has a line with the version, then for each directory a line with
+ * its path, device, inode and mtime followed by a line for each file in it
+ * and an empty line.
+ *
+ * @return allocated null terminated contents of the file or NULL
+ */
+static char * read_path_cache(void)
+{
+     char fname[MAX_FILE_PATH_LEN];
+     char * path = get_cache_dir();
+     struct stat details;
+     char * cache = NULL;
+     FILE * fp;
+
+     snprintf(fname, sizeof(fname), "%s/%s", path, PATH_CACHE_FILE);
+     free(path);
+     if(!(fp = fopen(fname, "rb")))
+     {
+          return NULL;
+     }
+     if((fstat(fileno(fp), &details) == 0) &&
+        ((cache = malloc(details.st_size + 1)) != NULL))
+     {
+          if(fread(cache, 1, details.st_size, fp) == details.st_size)
+          {
+               cache[details.st_size] = '\0';
+          }
+          else
+          {
+               cache[0] = '\0';
+          }
+          if(strncmp(cache, "#" VERSION "\n", strlen(VERSION) + 2) != 0)
+          {
+               free(cache);
+               cache = NULL;
+          }
+     }
+     fclose(fp);
+     return cache;
+}
+
+/**
+ * Find the saved listing of a directory, it is only used if the directory
+ * has not changed since
+ *
+ * @param[in] cache The contents of the saved listings
+ * @param[in] dir The directory
+ * @param[in] details The details of the directory now
+ *
+ * @return The start of the list of files or NULL
+ */
+static const char * find_cached_listing(const char * cache, const char * dir,
+                                                 const struct stat * details)
+{
+     const size_t len = strlen(dir);
+     const char * p = cache ? strchr(cache, '\n') : NULL;
+
+     while(p && p[1])
+     {
+          p++;
+          if((strncmp(p, dir, len) == 0) && (p[len] == '\t'))
+          {
+               char * end;
+               const unsigned long long dev = strtoull(&p[len + 1], &end, 10);
+               const unsigned long long ino = strtoull(end, &end, 10);
+               const long long mtime = strtoll(end, &end, 10);
+
+               if((*end == '\n') && (dev == details->st_dev) &&
+                  (ino == details->st_ino) && (mtime == details->st_mtime))
+               {
+                    return &end[1];
+               }
+          }
+          /* Skip to the empty line before the next directory */
+          if((p = strstr(p, "\n\n")) != NULL)
+          {
+               p++;
+          }
+     }
+     return NULL;
+}
+
+/**
+ * Read the directories in PATH once and index the files in them, so that
+ * finding an application is a lookup in memory rather than a stat() for
+ * each directory in PATH. The listings are saved in the cache directory
+ * and a directory that has not changed since is not read again.
+ */
+static void index_path(void)
+{
+     const char * path = getenv("PATH");
+     char fname[MAX_FILE_PATH_LEN];
+     char tmpName[MAX_FILE_PATH_LEN];
+     char * cache;
+     char * cacheDir;
+     const time_t now = time(NULL);
+     FILE * fp;
+     char * wip;
+     char * sep;
+     int i;
+
+     if(g_indexedPath)
+     {
+          return;
+     }
+     g_indexedPath = true;
+     if(!path || !(wip = strdup(path)))
+     {
+          return;
+     }
+
+     /* g_pathDirs[0] holds the copy of PATH the others point into */
+     do
+     {
+          if(!(g_pathDirs = realloc(g_pathDirs, (g_numPathDirs + 1) * sizeof(char *))))
+          {
+               ERROR("malloc error\n");
+          }
+          g_pathDirs[g_numPathDirs++] = wip;
+          if( (sep = strchr(wip, ':')) != NULL)
+          {
+               *sep = '\0';
+          }
+          if((wip[0] != '\0') && (wip[strlen(wip) - 1] == '/'))
+          {
+               wip[strlen(wip) - 1] = '\0';
+          }
+          wip = sep ? &sep[1] : NULL;
+     }
+     while(wip);
+
+     cache = read_path_cache();
+     cacheDir = get_cache_dir();
+     snprintf(fname, sizeof(fname), "%s/%s", cacheDir, PATH_CACHE_FILE);
+     snprintf(tmpName, sizeof(tmpName), "%s/%s.tmp", cacheDir, PATH_CACHE_FILE);
+     free(cacheDir);
+     if((fp = fopen(tmpName, "wb")) != NULL)
+     {
+          fprintf(fp, "#%s\n", VERSION);
+     }
+
+     /* Indexed last to first, so that the entries for a name end up in PATH
+      * order */
+     for(i = g_numPathDirs - 1; i >= 0; i--)
+     {
+          const char * dir = g_pathDirs[i][0] ? g_pathDirs[i] : "/";
+          const char * listing;
+          struct stat details;
+          bool save;
+          int j;
+
+          for(j = 0; (j < i) && (strcmp(g_pathDirs[j], g_pathDirs[i]) != 0); j++)
+          {
+          }
+          if(j < i)
+          {
+               continue;
+          }
+
+          /* An application installed in or removed from the directory
+           * changes the result */
+          add_manifest_source(dir);
+          if(stat(dir, &details) != 0)
+          {
+               continue;
+          }
+
+          /* A directory changed in the same second as it is read could
+           * change again without its mtime changing, so is not saved */
+          save = fp && (details.st_mtime < now - 1);
+          if(save)
+          {
+               fprintf(fp, "%s\t%llu\t%llu\t%lld\n", dir,
+                                (unsigned long long) details.st_dev,
+                                (unsigned long long) details.st_ino,
+                                (long long) details.st_mtime);
+          }
+
+          if((listing = find_cached_listing(cache, dir, &details)) != NULL)
+          {
+               const char * end;
+               for(; (*listing != '\n') && (end = strchr(listing, '\n')); listing = &end[1])
+               {
+                    add_path_entry(listing, end - listing, i);
+                    if(save)
+                    {
+                         fwrite(listing, 1, end - listing + 1, fp);
+                    }
+               }
+          }
+          else
+          {
+               struct dirent * ent;
+               DIR * dp;
+
+               LOG_DEBUG("Reading PATH directory '%s'\n", dir);
+               if((dp = opendir(dir)) != NULL)
+               {
+                    while((ent = readdir(dp)) != NULL)
+                    {
+                         if((ent->d_name[0] == '.') || strchr(ent->d_name, '\n'))
+                         {
+                              continue;
+                         }
+                         add_path_entry(ent->d_name, strlen(ent->d_name), i);
+                         if(save)
+                         {
+                              fprintf(fp, "%s\n", ent->d_name);
+                         }
+                    }
+                    closedir(dp);
+               }
+          }
+          if(save)
+          {
+               fputc('\n', fp);
+          }
+     }
+     LOG_DEBUG("Indexed %i PATH directories\n", g_numPathDirs);
+
+     free(cache);
+     if(fp)
+     {
+          if((fclose(fp) != 0) || (rename(tmpName, fname) != 0))
+          {
+               unlink(tmpName);
+          }
+     }
+}
+
+/**
+ * Find an application in the PATH directories, it must be an executable
+ * file
+ *
+ * @param[in] file The application name
+ *
+ * @return allocated full path or NULL.
+ */
+static char * find_in_path(const char * file)
+{
+     pathEntry_t * entry;
+
+     index_path();
+     entry = g_pathIndex[hash_name(file) & (PATH_INDEX_SIZE - 1)];
+     for(; entry; entry = entry->pNext)
+     {
+          char fname[MAX_FILE_PATH_LEN];
+          struct stat filestat;
+
+          if(strcmp(entry->name, file) != 0)
+          {
+               continue;
+          }
+          snprintf(fname, sizeof(fname), "%s/%s", g_pathDirs[entry->dirIdx], file);
+          if((stat(fname, &filestat) == 0) && S_ISREG(filestat.st_mode) &&
+                                                   (access(fname, X_OK) == 0))
+          {
+               return strdup(fname);
+          }
+     }
+     return NULL;
+}
+
 /**
  * Check if application 'file' exists. Uses a cache of previous finds to
- * avoid performing a stat call on the same file over and over again.
+ * avoid looking for the same application over and over again.
  *
  * @param[in] file The application to find
  *
@@ -351,11 +874,12 @@ static const char * find_application(const char * file)
      };
 
      struct stat filestat;
+     appCacheEntry_t ** bucket = &g_cache[hash_name(file) & (APP_CACHE_SIZE - 1)];
      appCacheEntry_t * p;
 
      LOG_DEBUG("find(%s)\n", file);
 
-     for(p = g_cache; p; p = p->pNext)
+     for(p = *bucket; p; p = p->pNext)
      {
           if( strcmp(p->shortName, file) == 0)
           {
@@ -369,18 +893,20 @@ static const char * find_application(const char * file)
 
      if (file[0] == '/')
      {
+          add_manifest_dir_of(file);
 	  if(stat(file, &filestat) == 0)
           {
                p->fullName = strdup(file);
           }
      }
+     else if(strchr(file, '/'))
+     {
+          /* Not a name that can be in the index */
+          p->fullName = find_helper_file(binPaths, file);
+     }
      else
      {
-          const char * q = find_helper_file(binPaths, file);
-          if(q)
-          {
-               p->fullName = q;
-          }
+          p->fullName = find_in_path(file);
      }
 
      if(p->fullName)
@@ -391,8 +917,8 @@ static const char * find_application(const char * file)
      {
           NOTICE("could not find '%s'\n", p->shortName);
      }
-     p->pNext = g_cache;
-     g_cache = p;
+     p->pNext = *bucket;
+     *bucket = p;
      return p->fullName;
 }
 
@@ -410,16 +936,38 @@ static void del_cache_entry(appCacheEntry_t * entry)
 }
 
 /**
- * Delete the application cache
+ * Delete the application cache and the PATH index
  */
 static void delete_cache(void)
 {
-     while(g_cache)
+     int i;
+
+     for(i = 0; i < APP_CACHE_SIZE; i++)
+     {
+          while(g_cache[i])
+          {
+               appCacheEntry_t * entry = g_cache[i];
+               g_cache[i] = entry->pNext;
+               del_cache_entry(entry);
+          }
+     }
+     for(i = 0; i < PATH_INDEX_SIZE; i++)
+     {
+          while(g_pathIndex[i])
+          {
+               pathEntry_t * entry = g_pathIndex[i];
+               g_pathIndex[i] = entry->pNext;
+               free(entry);
+          }
+     }
+     if(g_pathDirs)
      {
-          appCacheEntry_t * entry = g_cache;
-          g_cache = entry->pNext;
-          del_cache_entry(entry);
+          free(g_pathDirs[0]);
+          free(g_pathDirs);
+          g_pathDirs = NULL;
      }
+     g_numPathDirs = 0;
+     g_indexedPath = false;
 }
 
 /**
@@ -496,6 +1044,9 @@ static int parse_flags(char **x, command_t *commandp)
 	  { "repeat", 		H_REPEATCOUNT 	},
 	  { "loop", 		H_LOOP 		},
 	  { "stream", 		H_STREAM 	},
+	  { "asfile", 		H_ASFILE 	},
+	  { "progressive", 	H_PROGRESSIVE 	},
+	  { "stdin", 		H_STDIN 	},
 	  { "ignore_errors",	H_IGNORE_ERRORS },
 	  { "exits", 		H_DAEMON 	},
 	  { "nokill", 		H_DAEMON 	},
@@ -1040,19 +1591,71 @@ static void close_config(FILE * fp, pid_t m4_pid)
 
 
 /**
- * Find configuration file, helper and controller executables. Call the
- * appropriate xxx_cb function to handle the action (e.g. for configuration
- * file, the parsering and reading into memory).
+ * Expand the macros in the config file without running m4, which is only
+ * needed if the config uses more of m4 than define and changequote.
  *
- * @param[in] plugibName The name of the plugin
+ * @param[in] fname The config file name
  *
- * @return A linked list of pluginTypes
+ * @return allocated string of the expanded config or NULL if m4 is needed
  */
-static pluginType_t * do_read_config(const char * config_fname)
+static char * expand_config(const char * fname)
 {
-     pluginType_t * plugins = NULL;
+     struct stat details;
+     char * text = NULL;
+     char * expanded;
+     ssize_t len = 0;
+     int fd;
+
+     if((fd = open(fname, O_RDONLY)) < 0)
+     {
+          return NULL;
+     }
+     if((fstat(fd, &details) == 0) && ((text = malloc(details.st_size + 1)) != NULL))
+     {
+          len = read(fd, text, details.st_size);
+     }
+     close(fd);
+     if(!text || (len != details.st_size))
+     {
+          free(text);
+          return NULL;
+     }
+
+     expanded = m4_expand(text, len);
+     free(text);
+     if(!expanded)
+     {
+          LOG_INFO("'%s' needs m4\n", fname);
+     }
+     return expanded;
+}
+
+/**
+ * Find configuration file, helper and controller executables. Call the
+ * appropriate xxx_cb function to handle the action (e.g. for configuration
+ * file, the parsering and reading into memory).
+ *
+ * @param[in] plugibName The name of the plugin
+ *
+ * @return A linked list of pluginTypes
+ */
+static pluginType_t * do_read_config(const char * config_fname)
+{
+     pluginType_t * plugins = NULL;
      pid_t m4_pid = 0;
      FILE * fp = NULL;
+     char * expanded = expand_config(config_fname);
+
+     /* An empty config can not be read from memory, leave it to m4 */
+     if(expanded && (fp = fmemopen(expanded, strlen(expanded), "r")))
+     {
+          LOG_INFO("Parsing '%s'\n", config_fname);
+          plugins = read_config(fp);
+          fclose(fp);
+          free(expanded);
+          return plugins;
+     }
+     free(expanded);
 
      fp = open_config(config_fname, &m4_pid);
      if(fp == NULL)
@@ -1200,17 +1803,109 @@ static pluginType_t * trim(pluginType_t * plugins)
 }
 
 /**
- * Write the mimetype to the mimetypes and cmds files
+ * Get the plugin types of a config file, the file is read the first time
+ * and the result shared by all the browsers whose config is the same file
+ * (compared by inode so links to it are also shared).
+ *
+ * @param[in] config_fname The config file
+ *
+ * @return The trimmed plugin types
+ */
+static pluginType_t * get_config(const char * config_fname)
+{
+     parsedConfig_t * cfg;
+     struct stat details;
+     int i;
+
+     if(stat(config_fname, &details) != 0)
+     {
+          ERROR("Failed to stat '%s'\n", config_fname);
+     }
+
+     for(i = 0; i < g_numParsedConfigs; i++)
+     {
+          cfg = &g_parsedConfigs[i];
+          if((cfg->dev == details.st_dev) && (cfg->ino == details.st_ino))
+          {
+               LOG_DEBUG("Already read '%s'\n", config_fname);
+               return cfg->plugins;
+          }
+     }
+
+     if(!(g_parsedConfigs = realloc(g_parsedConfigs,
+                           (g_numParsedConfigs + 1) * sizeof(parsedConfig_t))))
+     {
+          ERROR("malloc error\n");
+     }
+     cfg = &g_parsedConfigs[g_numParsedConfigs++];
+     cfg->dev = details.st_dev;
+     cfg->ino = details.st_ino;
+     cfg->plugins = trim(do_read_config(config_fname));
+     return cfg->plugins;
+}
+
+/**
+ * Write the mimetype to the cmds file
  *
  * @param[in] type Pointer to the mimetype structure.
- * @param[in] mimetypes_fp Pointer to the mimetypes file
  * @param[in] cmds_fp Pointer to the cmds file
  */
-static void write_type(mimetype_t * type, FILE * mimetypes_fp, FILE * cmds_fp)
+static void write_type(mimetype_t * type, FILE * cmds_fp)
 {
+     const char * p;
+
      LOG_DEBUG("%s\n", type->type);
-     fprintf(mimetypes_fp, "%s:%s;", type->type, type->desc);
-     fprintf(cmds_fp, "%s\n", type->type);
+
+     /* mimetypes are matched ignoring case, so save mozplugger.so the work */
+     for(p = type->type; *p; p++)
+     {
+          fputc(tolower((unsigned char) *p), cmds_fp);
+     }
+     fputc('\n', cmds_fp);
+}
+
+/**
+ * Work out in which contexts (see DB_CTX_xxx) a command can be used, this
+ * saves mozplugger.so checking the flags of every command on every lookup.
+ *
+ * @param[in] flags The flags of the command
+ *
+ * @return Mask of DB_CTX_BIT() of the contexts
+ */
+static uint32_t cmd_accept_mask(unsigned flags)
+{
+#define MODE_MASK (H_NOEMBED | H_EMBED)
+     uint32_t accept = 0;
+     unsigned ctx;
+
+     for(ctx = 0; ctx < DB_NUM_CTX; ctx++)
+     {
+          const unsigned mode = ((ctx & DB_CTX_EMBED) ? H_EMBED : 0)
+                              | ((ctx & DB_CTX_NOEMBED) ? H_NOEMBED : 0)
+                              | ((ctx & DB_CTX_LINKS) ? H_LINKS : 0);
+
+          /* If command is specific to a particular mode, it must match */
+          if((flags & MODE_MASK) && ((mode & MODE_MASK) != (flags & MODE_MASK)))
+          {
+               continue;
+          }
+          /* The links helper requires a mode specific command */
+          if((mode & H_LINKS) && !(flags & MODE_MASK))
+          {
+               continue;
+          }
+          if((flags & H_LOOP) && !(ctx & DB_CTX_LOOP))
+          {
+               continue;
+          }
+          if((ctx & DB_CTX_STREAM) && !(flags & H_STREAM))
+          {
+               continue;
+          }
+          accept |= DB_CTX_BIT(ctx);
+     }
+     return accept;
+#undef MODE_MASK
 }
 
 /**
@@ -1222,24 +1917,23 @@ static void write_type(mimetype_t * type, FILE * mimetypes_fp, FILE * cmds_fp)
 static void write_cmd(command_t * cmd, FILE * fp)
 {
      LOG_DEBUG("\t0x%x\t%s\t%s:%s\n", cmd->flags, cmd->winname, cmd->fmatchStr, cmd->cmd);
-     fprintf(fp, "\t%x\t%s\t%s\t%s\n", cmd->flags, cmd->winname ? cmd->winname : "", cmd->fmatchStr ? cmd->fmatchStr : "", cmd->cmd);
+     fprintf(fp, "\t%x\t%x\t%s\t%s\t%s\n", cmd->flags, cmd_accept_mask(cmd->flags), cmd->winname ? cmd->winname : "", cmd->fmatchStr ? cmd->fmatchStr : "", cmd->cmd);
 }
 
 /**
- * Write the handler to the mimetypes and cmds files
+ * Write the handler to the cmds file
  *
  * @param[in] handler Pointer to the handler structure.
- * @param[in] mimetypes_fp Pointer to the mimetypes file
  * @param[in] cmds_fp Pointer to the cmds file
  */
-static void write_handler(handler_t * handler, FILE * mimetypes_fp, FILE * cmds_fp)
+static void write_handler(handler_t * handler, FILE * cmds_fp)
 {
      mimetype_t * type = handler->types;
      command_t * cmd = handler->cmds;
 
      for(; type; type = type->pNext)
      {
-          write_type(type, mimetypes_fp, cmds_fp);
+          write_type(type, cmds_fp);
      }
      for(; cmd; cmd = cmd->pNext)
      {
@@ -1247,6 +1941,290 @@ static void write_handler(handler_t * handler, FILE * mimetypes_fp, FILE * cmds_
      }
 }
 
+/**
+ * Build the mimetypes description of a plugin group that is returned by
+ * NP_GetMIMEDescription().
+ *
+ * @param[in] plugin The plugin config tree.
+ *
+ * @return allocated string containing the description
+ */
+static char * get_mimetypes_desc(pluginType_t * plugin)
+{
+     handler_t * handler;
+     mimetype_t * type;
+     size_t len = 1;
+     char * desc;
+     char * p;
+
+     for(handler = plugin->handlers; handler; handler = handler->pNext)
+     {
+          for(type = handler->types; type; type = type->pNext)
+          {
+               len += strlen(type->type) + strlen(type->desc) + 2;
+          }
+     }
+
+     if(!(desc = malloc(len)))
+     {
+          ERROR("malloc error\n");
+     }
+     p = desc;
+     *p = '\0';
+     for(handler = plugin->handlers; handler; handler = handler->pNext)
+     {
+          for(type = handler->types; type; type = type->pNext)
+          {
+               p += sprintf(p, "%s:%s;", type->type, type->desc);
+          }
+     }
+     return desc;
+}
+
+/**
+ * Add a string to the string table of the commands database image. As the
+ * config is generated by m4 macros many strings are repeated, so only one
+ * copy of each string is kept.
+ *
+ * @param[in,out] img The image being built
+ * @param[in] str The string (can be NULL)
+ *
+ * @return offset of the string in the image or zero if str is NULL
+ */
+static size_t db_add_string(dbImage_t * img, const char * str)
+{
+     unsigned hash = DB_HASH_INIT;
+     const char * p;
+     size_t slot;
+     size_t off;
+     size_t len;
+
+     if(!str)
+     {
+          return 0;
+     }
+
+     for(p = str; *p; p++)
+     {
+          hash = DB_HASH_STEP(hash, *p);
+     }
+     for(slot = hash & img->strTableMask; img->strTable[slot] != 0;
+                                     slot = (slot + 1) & img->strTableMask)
+     {
+          if(strcmp(&img->buf[img->strTable[slot]], str) == 0)
+          {
+               return img->strTable[slot];
+          }
+     }
+
+     len = strlen(str) + 1;
+     if(img->len + len > img->size)
+     {
+          img->size = 2 * (img->len + len);
+          if(!(img->buf = realloc(img->buf, img->size)))
+          {
+               ERROR("malloc error\n");
+          }
+     }
+     off = img->len;
+     memcpy(&img->buf[off], str, len);
+     img->len += len;
+     img->strTable[slot] = off;
+     return off;
+}
+
+/**
+ * Set a reference in the commands database image
+ *
+ * @param[in,out] img The image being built
+ * @param[in] refOff The offset of the reference
+ * @param[in] targetOff The offset of what is referenced (zero for NULL)
+ */
+static void db_set_ref(dbImage_t * img, size_t refOff, size_t targetOff)
+{
+     db_ref_t * ref = (db_ref_t *) &img->buf[refOff];
+     *ref = targetOff ? (db_ref_t) targetOff - (db_ref_t) refOff : 0;
+}
+
+/**
+ * Build the section of the binary commands database for a plugin group, the
+ * sections of all the groups are written to the one file by
+ * write_cmds_db() once all the groups have been processed.
+ *
+ * @param[in] plugin The plugin config tree.
+ * @param[in] cfgIdx The config tree idx.
+ */
+static void add_cmds_db_section(pluginType_t * plugin, int cfgIdx)
+{
+     dbImage_t img;
+     db_header_t * hdr;
+     handler_t * handler;
+     unsigned numHandlers = 0;
+     unsigned numTypes = 0;
+     unsigned numCmds = 0;
+     size_t hOff;
+     size_t tOff;
+     size_t cOff;
+     size_t sOff;
+
+     for(handler = plugin->handlers; handler; handler = handler->pNext)
+     {
+          mimetype_t * type;
+          command_t * cmd;
+
+          numHandlers++;
+          for(type = handler->types; type; type = type->pNext)
+          {
+               numTypes++;
+          }
+          for(cmd = handler->cmds; cmd; cmd = cmd->pNext)
+          {
+               numCmds++;
+          }
+     }
+
+     hOff = CMDS_DB_ALIGN(sizeof(db_header_t));
+     tOff = hOff + numHandlers * sizeof(db_handler_t);
+     cOff = tOff + numTypes * sizeof(db_mimetype_t);
+     sOff = cOff + numCmds * sizeof(db_command_t);
+
+     img.len = sOff;
+     img.size = sOff + 4096;
+     if(!(img.buf = calloc(1, img.size)))
+     {
+          ERROR("malloc error\n");
+     }
+
+     /* Sized so it is at most half full with every string distinct */
+     for(img.strTableMask = 1; img.strTableMask < 2 * (1 + numTypes + 3 * numCmds);
+                                                        img.strTableMask <<= 1)
+     {
+     }
+     if(!(img.strTable = calloc(img.strTableMask, sizeof(size_t))))
+     {
+          ERROR("malloc error\n");
+     }
+     img.strTableMask--;
+
+     /* Strings table always starts with an empty string, so that the image
+      * always ends with a terminator */
+     db_add_string(&img, "");
+
+     numHandlers = 0;
+     numTypes = 0;
+     numCmds = 0;
+     for(handler = plugin->handlers; handler; handler = handler->pNext)
+     {
+          const size_t h = hOff + numHandlers++ * sizeof(db_handler_t);
+          mimetype_t * type;
+          command_t * cmd;
+
+          db_set_ref(&img, h + offsetof(db_handler_t, types),
+                                       tOff + numTypes * sizeof(db_mimetype_t));
+          db_set_ref(&img, h + offsetof(db_handler_t, cmds),
+                                        cOff + numCmds * sizeof(db_command_t));
+
+          for(type = handler->types; type; type = type->pNext)
+          {
+               const size_t t = tOff + numTypes * sizeof(db_mimetype_t);
+               char * lower = strdup(type->type);
+               db_mimetype_t * m;
+               uint32_t hash = DB_HASH_INIT;
+               char * p;
+
+               if(!lower)
+               {
+                    ERROR("malloc error\n");
+               }
+               for(p = lower; *p; p++)
+               {
+                    *p = tolower((unsigned char) *p);
+                    hash = DB_HASH_STEP(hash, *p);
+               }
+
+               db_set_ref(&img, t + offsetof(db_mimetype_t, type),
+                                                   db_add_string(&img, lower));
+               m = (db_mimetype_t *) &img.buf[t];
+               m->hash = hash;
+               m->len = p - lower;
+               m->flags = (strcmp(lower, "*") == 0) ? DB_MIMETYPE_ANY : 0;
+               free(lower);
+
+               ((db_handler_t *) &img.buf[h])->numTypes++;
+               numTypes++;
+          }
+
+          for(cmd = handler->cmds; cmd; cmd = cmd->pNext)
+          {
+               const size_t c = cOff + numCmds * sizeof(db_command_t);
+               const char * fmatch = cmd->fmatchStr;
+               uint32_t kind = DB_FMATCH_NONE;
+               db_command_t * rec;
+
+               if(fmatch)
+               {
+                    switch(fmatch[0])
+                    {
+                    case '*':
+                         kind = DB_FMATCH_PREFIX;
+                         fmatch++;
+                         break;
+                    case '%':
+                         kind = DB_FMATCH_SUFFIX;
+                         fmatch++;
+                         break;
+                    default:
+                         kind = DB_FMATCH_SUBSTR;
+                         break;
+                    }
+               }
+
+               db_set_ref(&img, c + offsetof(db_command_t, cmd),
+                                                db_add_string(&img, cmd->cmd));
+               db_set_ref(&img, c + offsetof(db_command_t, winname),
+                                            db_add_string(&img, cmd->winname));
+               db_set_ref(&img, c + offsetof(db_command_t, fmatchStr),
+                                                 db_add_string(&img, fmatch));
+               rec = (db_command_t *) &img.buf[c];
+               rec->flags = cmd->flags;
+               rec->accept = cmd_accept_mask(cmd->flags);
+               rec->fmatchKind = kind;
+               rec->fmatchLen = fmatch ? strlen(fmatch) : 0;
+
+               ((db_handler_t *) &img.buf[h])->numCmds++;
+               numCmds++;
+          }
+     }
+
+     hdr = (db_header_t *) img.buf;
+     memcpy(hdr->magic, CMDS_DB_MAGIC, sizeof(hdr->magic));
+     strncpy(hdr->version, VERSION, sizeof(hdr->version));
+     hdr->format = CMDS_DB_FORMAT;
+     hdr->size = img.len;
+     hdr->numHandlers = numHandlers;
+     hdr->numTypes = numTypes;
+     hdr->numCmds = numCmds;
+     hdr->stringsLen = img.len - sOff;
+     db_set_ref(&img, offsetof(db_header_t, handlers), hOff);
+     db_set_ref(&img, offsetof(db_header_t, strings), sOff);
+
+     free(img.strTable);
+     img.strTable = NULL;
+
+     if(cfgIdx >= g_numDbSections)
+     {
+          const int num = cfgIdx + 1;
+          if(!(g_dbSections = realloc(g_dbSections, num * sizeof(dbImage_t))))
+          {
+               ERROR("malloc error\n");
+          }
+          memset(&g_dbSections[g_numDbSections], 0,
+                                    (num - g_numDbSections) * sizeof(dbImage_t));
+          g_numDbSections = num;
+     }
+     g_dbSections[cfgIdx] = img;
+}
+
 /**
  * Get the directory where cached config files are put
  *
@@ -1309,73 +2287,167 @@ static char * get_cache_dir(void)
 }
 
 
-#define BUF_LEN (1024)
+#ifdef READ_FROM_INT_BLOB
+extern unsigned char _binary_mozplugger_so_start[];
+extern unsigned char _binary_mozplugger_so_end[];
+extern unsigned char _binary_mozplugger_stub_so_start[];
+extern unsigned char _binary_mozplugger_stub_so_end[];
+#endif
 
 /**
- * Return the length of the longest string
+ * Write all of a buffer to a file
  *
- * @param[in] str1 String 1
- * @param[in] str2 String 2
+ * @param[in] fd The file
+ * @param[in] buf The buffer
+ * @param[in] len The length of the buffer
  *
- * @return The max length
+ * @return true if all was written
  */
-static size_t max_string_len(const char * str1, const char * str2)
+static bool write_all(int fd, const char * buf, size_t len)
 {
-    const size_t len1 = strlen(str1);
-    const size_t len2 = strlen(str2);
-    return (len1 > len2) ? len1 : len2;
+     while(len > 0)
+     {
+          const ssize_t n = write(fd, buf, len);
+          if(n < 0)
+          {
+               if(errno == EINTR)
+               {
+                    continue;
+               }
+               return false;
+          }
+          buf += n;
+          len -= n;
+     }
+     return true;
 }
 
-#ifdef READ_FROM_INT_BLOB
-extern unsigned char _binary_mozplugger_so_start[];
-extern unsigned char _binary_mozplugger_so_end[];
-unsigned char * blob_pos;
-#endif
+/**
+ * Put a value in place of a place holder string in a plugin written by
+ * write_copy().
+ *
+ * @param[in] fd The file written
+ * @param[in] contents The contents written
+ * @param[in] len The length of the contents
+ * @param[in] placeHolder The place holder string
+ * @param[in] value The value, NULL to leave the place holder
+ *
+ * @return false if failed to write
+ */
+static bool put_value(int fd, const char * contents, size_t len,
+                                 const char * placeHolder, const char * value)
+{
+     const char * p;
+     size_t valueLen;
 
+     if(!value)
+     {
+          return true;
+     }
 
-void * open_mozplugger_so(const char * path)
-{
-#ifdef READ_FROM_INT_BLOB
-    LOG_INFO("- using internal blob as source\n");
-    LOG_DEBUG("open_mozplugger_so %p\n", _binary_mozplugger_so_start);
-    blob_pos = _binary_mozplugger_so_start;
-    return (void *) &blob_pos;
-#else
-    LOG_INFO("- using '%s' as source\n", path);
-    return (void *) fopen(path, "rb");
-#endif
+     /* Match the terminator too, as the value is a whole string */
+     if((p = memmem(contents, len, placeHolder, strlen(placeHolder) + 1)) == NULL)
+     {
+          NOTICE("No place holder '%s'\n", placeHolder);
+          return true;
+     }
+     valueLen = strlen(value) + 1;
+     return pwrite(fd, value, valueLen, p - contents) == valueLen;
 }
 
-void close_mozplugger_so(void * handle)
+/**
+ * Write a copy of a plugin with the magic value and the path of the core
+ * put in. These replace the place holder strings, the rest of the file is
+ * copied as is, in the kernel if possible.
+ *
+ * @param[in] contents The contents of the plugin
+ * @param[in] len The length of the contents
+ * @param[in] inFd The open file of the contents, -1 for an internal blob
+ * @param[in] out filename of destination
+ * @param[in] magic The magic string
+ * @param[in] corePath The path of the core, NULL if not a stub
+ */
+static void write_copy(const char * contents, size_t len, int inFd,
+               const char * out, const char * magic, const char * corePath)
 {
-#ifndef READ_FROM_INT_BLOB
-    fclose((FILE *)handle);
+     size_t done = 0;
+     int outFd;
+     bool ok;
+
+     if((outFd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+     {
+          ERROR("Failed to open '%s'\n", out);
+     }
+
+#ifdef HAVE_COPY_FILE_RANGE
+     while((inFd >= 0) && (done < len))
+     {
+          const ssize_t n = copy_file_range(inFd, NULL, outFd, NULL, len - done, 0);
+          if(n <= 0)
+          {
+               /* Not supported between these files, write it instead */
+               break;
+          }
+          done += n;
+     }
 #endif
+     ok = write_all(outFd, &contents[done], len - done)
+          && put_value(outFd, contents, len, PLACE_HOLDER_STR, magic)
+          && put_value(outFd, contents, len, CORE_PLACE_HOLDER_STR, corePath);
+
+     if((close(outFd) != 0) || !ok)
+     {
+          ERROR("Failed to write '%s'\n", out);
+     }
 }
 
+#ifndef READ_FROM_INT_BLOB
+/**
+ * Get the contents of the mozplugger.so to copy, the file mapped into memory
+ *
+ * @param[in] path The path of the mozplugger.so
+ * @param[out] pLen The length of the contents
+ * @param[out] pFd The open file
+ *
+ * @return Pointer to the contents or NULL
+ */
+static const char * open_mozplugger_so(const char * path, size_t * pLen, int * pFd)
+{
+     struct stat details;
+     void * contents;
+     int fd;
+
+     LOG_INFO("- using '%s' as source\n", path);
+     if((fd = open(path, O_RDONLY)) < 0)
+     {
+          return NULL;
+     }
+     if((fstat(fd, &details) != 0) || (details.st_size == 0) ||
+        ((contents = mmap(NULL, details.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+     {
+          close(fd);
+          return NULL;
+     }
+     *pLen = details.st_size;
+     *pFd = fd;
+     return (const char *) contents;
+}
 
-static size_t read_mozplugger_so(char * buffer, size_t bufLen, void * in)
+/**
+ * Release the contents of the mozplugger.so
+ *
+ * @param[in] contents The contents
+ * @param[in] len The length of the contents
+ * @param[in] fd The open file
+ */
+static void close_mozplugger_so(const char * contents, size_t len, int fd)
 {
-#ifdef READ_FROM_INT_BLOB
-    unsigned char ** ppBlob = (unsigned char **)in;
-    size_t len = _binary_mozplugger_so_end - *ppBlob;
-    if(len > 0)
-    {
-/*        NOTICE("read_mozplugger_so %p %u\n", *ppBlob, len); */
-        if(len > bufLen)
-            len = bufLen;
-        memcpy(buffer, *ppBlob, len);
-        *ppBlob += len;
-    }
-    return len;
-#else
-    FILE * inFp = (FILE *)in;
-    return fread(buffer, 1, bufLen, inFp);
-#endif
+     munmap((void *) contents, len);
+     close(fd);
 }
 
 /**
- * Copy mozplugger.so from in to out and add in the magic value
+ * Copy mozplugger.so from in to out and add in the magic value.
  *
  * @param[in] in filename of source
  * @param[in] out filename of destination
@@ -1383,64 +2455,101 @@ static size_t read_mozplugger_so(char * buffer, size_t bufLen, void * in)
  */
 static int copy(const char * in, const char * out, const char * magic)
 {
-    char buffer[BUF_LEN];
-    void * inFp;
-    FILE * outFp;
-    bool found = false;
-    size_t extra;
-    size_t len;
+     const char * contents;
+     size_t len;
+     int inFd;
 
-    LOG_INFO("Creating '%s' for '%s'\n", out, magic);
+     LOG_INFO("Creating '%s' for '%s'\n", out, magic);
 
-    if( !(inFp = open_mozplugger_so(in)))
-    {
-        NOTICE("Failed to open '%s'\n", in);
-        return 0;
-    }
-    if( !(outFp = fopen(out, "wb")))
-    {
-        close_mozplugger_so(inFp);
-        ERROR("Failed to open '%s'\n", out);
-    }
+     if( !(contents = open_mozplugger_so(in, &len, &inFd)))
+     {
+          NOTICE("Failed to open '%s'\n", in);
+          return 0;
+     }
+     write_copy(contents, len, inFd, out, magic, NULL);
+     close_mozplugger_so(contents, len, inFd);
+     return 1;
+}
+
+#else
+/**
+ * Check if a file already has the given contents
+ *
+ * @param[in] fname The file
+ * @param[in] contents The contents
+ * @param[in] len The length of the contents
+ *
+ * @return true if the same
+ */
+static bool chk_same_contents(const char * fname, const void * contents, size_t len)
+{
+     struct stat details;
+     void * image;
+     bool same = false;
+     int fd;
 
-    extra = max_string_len(PLACE_HOLDER_STR, magic)+1;
-    len = read_mozplugger_so(buffer, BUF_LEN, inFp);
+     if((fd = open(fname, O_RDONLY)) < 0)
+     {
+          return false;
+     }
+     if((fstat(fd, &details) == 0) && (details.st_size == len) &&
+        ((image = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED))
+     {
+          same = (memcmp(image, contents, len) == 0);
+          munmap(image, len);
+     }
+     close(fd);
+     return same;
+}
 
-    while(1)
-    {
-        char * p;
-        for(p = buffer; p < &buffer[BUF_LEN-extra]; p++)
-        {
-            if(strcmp(p, PLACE_HOLDER_STR) == 0)
-            {
-                strcpy(p, magic);
-                found = true;
-                break;
-            }
-        }
+/**
+ * Put the core mozplugger.so that the stub plugins load in the cache
+ * directory, unless it is already there. It is replaced by renaming so that
+ * a browser that is running keeps the one it has loaded.
+ *
+ * @return The path of the core
+ */
+static const char * install_core(void)
+{
+     static char corePath[MAX_FILE_PATH_LEN];
+     char tmpPath[MAX_FILE_PATH_LEN];
+     char * path;
+
+     if(corePath[0] != '\0')
+     {
+          return corePath;
+     }
 
-        if(found || (len < BUF_LEN))
-        {
-            break;
-        }
+     path = get_cache_dir();
+     snprintf(corePath, sizeof(corePath), "%s/%s", path, CORE_FILE);
+     snprintf(tmpPath, sizeof(tmpPath), "%s/%s.tmp", path, CORE_FILE);
+     free(path);
 
-        len -= fwrite(buffer, 1, BUF_LEN-extra, outFp);
-        memcpy(buffer, &buffer[BUF_LEN-extra], len);
-        len += read_mozplugger_so(&buffer[len], BUF_LEN - len, inFp);
-    }
+     if(strlen(corePath) >= MAX_CORE_PATH_LEN)
+     {
+          ERROR("Path '%s' is too long\n", corePath);
+     }
 
-     fwrite(buffer, 1, len, outFp);
-     while((len = read_mozplugger_so(buffer, 1024, inFp)) > 0)
+     if(!chk_same_contents(corePath, _binary_mozplugger_so_start,
+                    _binary_mozplugger_so_end - _binary_mozplugger_so_start))
      {
-          fwrite(buffer, 1, len, outFp);
+          LOG_INFO("Creating '%s'\n", corePath);
+          write_copy((const char *) _binary_mozplugger_so_start,
+                    _binary_mozplugger_so_end - _binary_mozplugger_so_start,
+                    -1, tmpPath, NULL, NULL);
+          if(rename(tmpPath, corePath) != 0)
+          {
+               ERROR("Failed to rename '%s'\n", tmpPath);
+          }
      }
-     close_mozplugger_so(inFp);
-     fclose(outFp);
-     return 1;
+     return corePath;
 }
+#endif
 
 /**
- * Install the plugin
+ * Install the plugin. With the internal blob this is a stub that loads the
+ * one core mozplugger.so shared by all the plugin groups, otherwise it is a
+ * copy of mozplugger.so.
  *
  * @param[in] localPluginDir The directory to place the plugin
  * @param[in] cfgIdx The config idx number
@@ -1451,11 +2560,11 @@ static void install(const char * localPluginDir, int cfgIdx, int pluginIdx)
 {
      char localPluginPath[MAX_FILE_PATH_LEN];
      char tmpPluginPath[MAX_FILE_PATH_LEN];
-     char globalPluginPath[MAX_FILE_PATH_LEN];
      char magic[MAX_PLUGIN_MAGIC_LEN];
-     char * p = GLOBAL_PLUGIN_DIRS "/usr/lib/mozilla/plugins /usr/lib/netscape/plugins "
-                                   "/usr/lib/firefox/plugins /usr/lib/chromium/plugins "
-                                   "/usr/local/lib/browser_plugins/mozplugger";
+#ifndef READ_FROM_INT_BLOB
+     char globalPluginPath[MAX_FILE_PATH_LEN];
+     const char * p = g_globalPluginDirs;
+#endif
 
      snprintf(tmpPluginPath, MAX_FILE_PATH_LEN, "%s/mozplugger.tmp", localPluginDir);
      snprintf(localPluginPath, MAX_FILE_PATH_LEN, "%s/mozplugger%i.so", localPluginDir, pluginIdx);
@@ -1464,10 +2573,16 @@ static void install(const char * localPluginDir, int cfgIdx, int pluginIdx)
      unlink(tmpPluginPath);
      rename(localPluginPath, tmpPluginPath);
 
+#ifdef READ_FROM_INT_BLOB
+     LOG_INFO("Creating stub '%s' for '%s'\n", localPluginPath, magic);
+     write_copy((const char *) _binary_mozplugger_stub_so_start,
+               _binary_mozplugger_stub_so_end - _binary_mozplugger_stub_so_start,
+               -1, localPluginPath, magic, install_core());
+#else
      do
      {
-          char * q;
-          p = skip_spaces(p);
+          const char * q;
+          p = skip_spaces((char *) p);
           for(q = p; (*q != ' ') && (*q != '\t') && (*q != '\0'); q++)
                ;
           if(q == p)
@@ -1478,22 +2593,15 @@ static void install(const char * localPluginDir, int cfgIdx, int pluginIdx)
           p = q;
      }
      while(!copy(globalPluginPath, localPluginPath, magic));
+#endif
 }
 
-/*
- * Write a list of the locations of the helpers to a config file
- *
- * @param[in] fp The File to write to
+/**
+ * Find the mozplugger helper executables, this is only done once however
+ * many plugin groups there are.
  */
-static void write_helpers(FILE * fp)
+static void find_helpers(void)
 {
-     static const char * helpers[] =
-     {
-          "mozplugger-linker",
-          "mozplugger-helper",
-          "mozplugger-controller"
-     };
-
      /* Places to search for the mozplugger helper executables */
      static const cfgPath_t pluginBinPaths[] =
      {
@@ -1507,11 +2615,32 @@ static void write_helpers(FILE * fp)
      };
 
      int i;
-     for(i = 0; i < sizeof(helpers)/sizeof(const char *); i++)
+
+     if(g_foundHelpers)
+     {
+          return;
+     }
+     for(i = 0; i < NUM_HELPERS; i++)
+     {
+          g_helperPaths[i] = find_helper_file(pluginBinPaths, g_helperNames[i]);
+     }
+     g_foundHelpers = true;
+}
+
+/*
+ * Write a list of the locations of the helpers to a config file
+ *
+ * @param[in] fp The File to write to
+ */
+static void write_helpers(FILE * fp)
+{
+     int i;
+
+     find_helpers();
+     for(i = 0; i < NUM_HELPERS; i++)
      {
-          char * exePath = find_helper_file(pluginBinPaths, helpers[i]);
-          fprintf(fp, "%s\t%s\n", &strchr(helpers[i], '-')[1], exePath);
-          free(exePath);
+          fprintf(fp, "%s\t%s\n", &strchr(g_helperNames[i], '-')[1],
+                                                              g_helperPaths[i]);
      }
 }
 
@@ -1544,31 +2673,516 @@ static void removeRest(const char * localPluginDir, int idx)
      }
 }
 
+/**
+ * Free the sections of the binary commands database
+ */
+static void delete_cmds_db_sections(void)
+{
+     int i;
+
+     for(i = 0; i < g_numDbSections; i++)
+     {
+          free(g_dbSections[i].buf);
+     }
+     free(g_dbSections);
+     g_dbSections = NULL;
+     g_numDbSections = 0;
+}
+
+/**
+ * Write the binary commands database that mozplugger.so maps directly
+ * instead of parsing the cmds file. The file is written under a temporary
+ * name and then renamed so that a running browser that has the old file
+ * mapped is not affected.
+ */
+static void write_cmds_db(void)
+{
+     char fname[MAX_FILE_PATH_LEN];
+     char tmpName[MAX_FILE_PATH_LEN];
+     db_set_header_t hdr;
+     db_section_t * sections;
+     const size_t dirSize = sizeof(hdr) + g_numDbSections * sizeof(db_section_t);
+     size_t offset = CMDS_DB_ALIGN(dirSize);
+     size_t end = dirSize;
+     char * path = get_cache_dir();
+     FILE * fp;
+     int i;
+
+     if(!(sections = calloc(g_numDbSections + 1, sizeof(db_section_t))))
+     {
+          ERROR("malloc error\n");
+     }
+     for(i = 0; i < g_numDbSections; i++)
+     {
+          sections[i].offset = offset;
+          sections[i].size = g_dbSections[i].len;
+          end = offset + g_dbSections[i].len;
+          offset = CMDS_DB_ALIGN(end);
+     }
+
+     memset(&hdr, 0, sizeof(hdr));
+     memcpy(hdr.magic, CMDS_DB_SET_MAGIC, sizeof(hdr.magic));
+     hdr.format = CMDS_DB_FORMAT;
+     hdr.numSections = g_numDbSections;
+     hdr.size = end;
+
+     snprintf(fname, sizeof(fname), "%s/%s", path, CMDS_DB_FILE);
+     snprintf(tmpName, sizeof(tmpName), "%s/%s.tmp", path, CMDS_DB_FILE);
+     if(!(fp = fopen(tmpName, "wb")))
+     {
+          ERROR("Failed to open '%s'\n", tmpName);
+     }
+     offset = dirSize;
+     if((fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ||
+        (fwrite(sections, sizeof(db_section_t), g_numDbSections, fp) != g_numDbSections))
+     {
+          fclose(fp);
+          ERROR("Failed to write '%s'\n", tmpName);
+     }
+     for(i = 0; i < g_numDbSections; i++)
+     {
+          static const char pad[8];
+          if((fwrite(pad, 1, sections[i].offset - offset, fp) != sections[i].offset - offset) ||
+             (fwrite(g_dbSections[i].buf, 1, g_dbSections[i].len, fp) != g_dbSections[i].len))
+          {
+               fclose(fp);
+               ERROR("Failed to write '%s'\n", tmpName);
+          }
+          offset = sections[i].offset + sections[i].size;
+     }
+     fclose(fp);
+     if(rename(tmpName, fname) != 0)
+     {
+          ERROR("Failed to rename '%s'\n", tmpName);
+     }
+     LOG_DEBUG("Wrote %s, %u sections, %u bytes\n", fname, g_numDbSections,
+                                                        (unsigned) hdr.size);
+     free(sections);
+     delete_cmds_db_sections();
+     free(path);
+}
+
+/**
+ * Record a plugin group for the manifest
+ *
+ * @param[in] plugin The plugin config tree.
+ * @param[in] cfgIdx The config tree idx.
+ * @param[in] desc The mimetypes description, now owned by the manifest
+ * @param[in] digest The digest of the files written for the group
+ */
+static void add_manifest_plugin(pluginType_t * plugin, int cfgIdx, char * desc,
+                                                                uint64_t digest)
+{
+     manifestPlugin_t * entry;
+
+     if(cfgIdx >= g_numManifestPlugins)
+     {
+          const int num = cfgIdx + 1;
+          if(!(g_manifestPlugins = realloc(g_manifestPlugins,
+                                             num * sizeof(manifestPlugin_t))))
+          {
+               ERROR("malloc error\n");
+          }
+          memset(&g_manifestPlugins[g_numManifestPlugins], 0,
+                          (num - g_numManifestPlugins) * sizeof(manifestPlugin_t));
+          g_numManifestPlugins = num;
+     }
+
+     entry = &g_manifestPlugins[cfgIdx];
+     entry->name = strdup(plugin->name);
+     entry->version = strdup(plugin->version);
+     entry->mimetypes = desc;
+     entry->digest = digest;
+     if(!entry->name || !entry->version)
+     {
+          ERROR("malloc error\n");
+     }
+}
+
+/**
+ * Write the manifest that mozplugger.so maps to get the descriptions of all
+ * the plugin groups and check the cache is up to date. As with the commands
+ * database it is written under a temporary name and then renamed.
+ */
+static void write_manifest(void)
+{
+     char fname[MAX_FILE_PATH_LEN];
+     char tmpName[MAX_FILE_PATH_LEN];
+     char * path = get_cache_dir();
+     manifest_header_t * hdr;
+     dbImage_t img;
+     const size_t srcOff = CMDS_DB_ALIGN(sizeof(manifest_header_t));
+     const size_t plOff = srcOff + g_numManifestSources * sizeof(manifest_source_t);
+     const size_t sOff = plOff + g_numManifestPlugins * sizeof(manifest_plugin_t);
+     FILE * fp;
+     int i;
+
+     img.len = sOff;
+     img.size = sOff + 4096;
+     if(!(img.buf = calloc(1, img.size)))
+     {
+          ERROR("malloc error\n");
+     }
+     for(img.strTableMask = 1;
+          img.strTableMask < 2 * (1 + NUM_HELPERS + g_numManifestSources
+                                             + 3 * g_numManifestPlugins);
+                                                        img.strTableMask <<= 1)
+     {
+     }
+     if(!(img.strTable = calloc(img.strTableMask, sizeof(size_t))))
+     {
+          ERROR("malloc error\n");
+     }
+     img.strTableMask--;
+     db_add_string(&img, "");
+
+     find_helpers();
+     db_set_ref(&img, offsetof(manifest_header_t, linker),
+                                       db_add_string(&img, g_helperPaths[0]));
+     db_set_ref(&img, offsetof(manifest_header_t, helper),
+                                       db_add_string(&img, g_helperPaths[1]));
+     db_set_ref(&img, offsetof(manifest_header_t, controller),
+                                       db_add_string(&img, g_helperPaths[2]));
+
+     for(i = 0; i < g_numManifestSources; i++)
+     {
+          const size_t off = srcOff + i * sizeof(manifest_source_t);
+          const manifestSource_t * src = &g_manifestSources[i];
+          manifest_source_t * rec;
+
+          db_set_ref(&img, off + offsetof(manifest_source_t, path),
+                                              db_add_string(&img, src->path));
+          rec = (manifest_source_t *) &img.buf[off];
+          rec->dev = src->details.st_dev;
+          rec->ino = src->details.st_ino;
+          rec->mtime = src->details.st_mtime;
+          rec->size = src->details.st_size;
+          rec->flags = src->exists ? 0 : MANIFEST_SRC_MISSING;
+          free(src->path);
+     }
+
+     for(i = 0; i < g_numManifestPlugins; i++)
+     {
+          const size_t off = plOff + i * sizeof(manifest_plugin_t);
+          manifestPlugin_t * entry = &g_manifestPlugins[i];
+
+          db_set_ref(&img, off + offsetof(manifest_plugin_t, name),
+                                             db_add_string(&img, entry->name));
+          db_set_ref(&img, off + offsetof(manifest_plugin_t, version),
+                                          db_add_string(&img, entry->version));
+          db_set_ref(&img, off + offsetof(manifest_plugin_t, mimetypes),
+                                        db_add_string(&img, entry->mimetypes));
+          ((manifest_plugin_t *) &img.buf[off])->digest = entry->digest;
+          free(entry->name);
+          free(entry->version);
+          free(entry->mimetypes);
+     }
+
+     hdr = (manifest_header_t *) img.buf;
+     memcpy(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic));
+     strncpy(hdr->version, VERSION, sizeof(hdr->version));
+     hdr->format = MANIFEST_FORMAT;
+     hdr->size = img.len;
+     hdr->updated = time(NULL);
+     hdr->numSources = g_numManifestSources;
+     hdr->numPlugins = g_numManifestPlugins;
+     db_set_ref(&img, offsetof(manifest_header_t, sources), srcOff);
+     db_set_ref(&img, offsetof(manifest_header_t, plugins), plOff);
+
+     snprintf(fname, sizeof(fname), "%s/%s", path, MANIFEST_FILE);
+     snprintf(tmpName, sizeof(tmpName), "%s/%s.tmp", path, MANIFEST_FILE);
+     if(!(fp = fopen(tmpName, "wb")))
+     {
+          ERROR("Failed to open '%s'\n", tmpName);
+     }
+     if(fwrite(img.buf, 1, img.len, fp) != img.len)
+     {
+          fclose(fp);
+          ERROR("Failed to write '%s'\n", tmpName);
+     }
+     fclose(fp);
+     if(rename(tmpName, fname) != 0)
+     {
+          ERROR("Failed to rename '%s'\n", tmpName);
+     }
+     LOG_DEBUG("Wrote %s, %u plugins, %u bytes\n", fname, g_numManifestPlugins,
+                                                          (unsigned) img.len);
+
+     free(img.buf);
+     free(img.strTable);
+     free(g_manifestPlugins);
+     g_manifestPlugins = NULL;
+     g_numManifestPlugins = 0;
+     free(g_manifestSources);
+     g_manifestSources = NULL;
+     g_numManifestSources = 0;
+     free(path);
+}
+
+/**
+ * Read the manifest left by the previous run, this is what the files in the
+ * cache and the plugin directories were last written from.
+ *
+ * @return allocated copy of the manifest or NULL if there is no usable one
+ */
+static manifest_header_t * read_prev_manifest(void)
+{
+     char fname[MAX_FILE_PATH_LEN];
+     char * path = get_cache_dir();
+     manifest_header_t * hdr = NULL;
+     struct stat details;
+     FILE * fp;
+
+     snprintf(fname, sizeof(fname), "%s/%s", path, MANIFEST_FILE);
+     free(path);
+     if(!(fp = fopen(fname, "rb")))
+     {
+          return NULL;
+     }
+     if((fstat(fileno(fp), &details) == 0) &&
+        (details.st_size >= sizeof(manifest_header_t)) &&
+        ((hdr = malloc(details.st_size)) != NULL))
+     {
+          if((fread(hdr, details.st_size, 1, fp) != 1) ||
+             (memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) != 0) ||
+             (hdr->format != MANIFEST_FORMAT) ||
+             (strncmp(hdr->version, VERSION, sizeof(hdr->version)) != 0) ||
+             (hdr->size != details.st_size))
+          {
+               free(hdr);
+               hdr = NULL;
+          }
+     }
+     fclose(fp);
+     return hdr;
+}
+
+/**
+ * Digest the mozplugger.so that install() would copy, or the stub and core
+ * that it would install, so that the plugins are reinstalled if it is
+ * replaced.
+ *
+ * @param[in] digest The digest so far
+ *
+ * @return The new digest
+ */
+static uint64_t digest_global_plugin(uint64_t digest)
+{
+#ifdef READ_FROM_INT_BLOB
+     digest = digest_bytes(digest, _binary_mozplugger_stub_so_start,
+          _binary_mozplugger_stub_so_end - _binary_mozplugger_stub_so_start);
+     return digest_bytes(digest, _binary_mozplugger_so_start,
+                    _binary_mozplugger_so_end - _binary_mozplugger_so_start);
+#else
+     char globalPluginPath[MAX_FILE_PATH_LEN];
+     const char * p = g_globalPluginDirs;
+
+     for(;;)
+     {
+          struct stat details;
+          const char * q;
+
+          p = skip_spaces((char *) p);
+          for(q = p; (*q != ' ') && (*q != '\t') && (*q != '\0'); q++)
+               ;
+          if(q == p)
+          {
+               return digest;
+          }
+          snprintf(globalPluginPath, sizeof(globalPluginPath), "%.*s/mozplugger.so", (int) (q-p), p);
+          if(stat(globalPluginPath, &details) == 0)
+          {
+               const int64_t mtime = details.st_mtime;
+               const uint64_t size = details.st_size;
+
+               digest = digest_str(digest, globalPluginPath);
+               digest = digest_bytes(digest, &mtime, sizeof(mtime));
+               return digest_bytes(digest, &size, sizeof(size));
+          }
+          p = q;
+     }
+#endif
+}
+
+/**
+ * Work out the digest of everything that is written for a plugin group,
+ * the cached config files, the section of the commands database and the
+ * copy of mozplugger.so.
+ *
+ * @param[in] config_fname The config file the group was read from
+ * @param[in] localPluginDir The local(user) directory where plugins live.
+ * @param[in] plugin The plugin config tree.
+ * @param[in] cfgIdx The config tree idx.
+ * @param[in] pluginIdx The plugin idx.
+ * @param[in] desc The mimetypes description of the group
+ *
+ * @return The digest
+ */
+static uint64_t get_group_digest(const char * config_fname,
+                          const char * localPluginDir, pluginType_t * plugin,
+                          int cfgIdx, int pluginIdx, const char * desc)
+{
+     const dbImage_t * section = &g_dbSections[cfgIdx];
+     uint64_t digest = DIGEST_INIT;
+     char buffer[32];
+     int i;
+
+     snprintf(buffer, sizeof(buffer), "%i:%i", cfgIdx, pluginIdx);
+     digest = digest_str(digest, buffer);
+     digest = digest_str(digest, config_fname);
+     digest = digest_str(digest, localPluginDir);
+     digest = digest_str(digest, plugin->name);
+     digest = digest_str(digest, plugin->version);
+     digest = digest_str(digest, desc);
+
+     find_helpers();
+     for(i = 0; i < NUM_HELPERS; i++)
+     {
+          digest = digest_str(digest, g_helperPaths[i]);
+     }
+
+     /* The section is position independent and zero padded, so it is the
+      * same bytes if the commands are the same */
+     digest = digest_bytes(digest, section->buf, section->len);
+     return digest_global_plugin(digest);
+}
+
+/**
+ * Check whether the files of a plugin group are as the previous run left
+ * them and that is what this run would write.
+ *
+ * @param[in] localPluginDir The local(user) directory where plugins live.
+ * @param[in] cfgIdx The config tree idx.
+ * @param[in] pluginIdx The plugin idx.
+ * @param[in] digest The digest of what this run would write
+ *
+ * @return true if the group does not need to be written
+ */
+static bool chk_group_current(const char * localPluginDir, int cfgIdx,
+                                                int pluginIdx, uint64_t digest)
+{
+     static const char * const cacheFiles[] =
+     {
+          "%s/%i.helpers", "%s/%i.mimetypes", "%s/%i.cmds"
+     };
+     char fname[MAX_FILE_PATH_LEN];
+     const manifest_plugin_t * prev;
+     struct stat details;
+     char * path;
+     bool current = true;
+     int i;
+
+     if(!g_prevManifest || (cfgIdx >= g_prevManifest->numPlugins))
+     {
+          return false;
+     }
+     prev = DB_DEREF(g_prevManifest->plugins);
+     if(prev[cfgIdx].digest != digest)
+     {
+          return false;
+     }
+
+     snprintf(fname, sizeof(fname), "%s/mozplugger%i.so", localPluginDir, pluginIdx);
+     if(stat(fname, &details) != 0)
+     {
+          return false;
+     }
+
+     path = get_cache_dir();
+     for(i = 0; current && (i < sizeof(cacheFiles)/sizeof(const char *)); i++)
+     {
+          snprintf(fname, sizeof(fname), cacheFiles[i], path, cfgIdx);
+          current = (stat(fname, &details) == 0);
+     }
+#ifdef READ_FROM_INT_BLOB
+     /* The stub is no use without the core */
+     if(current)
+     {
+          snprintf(fname, sizeof(fname), "%s/%s", path, CORE_FILE);
+          current = (stat(fname, &details) == 0);
+     }
+#endif
+     free(path);
+     return current;
+}
+
+/**
+ * Check whether the commands database left by the previous run has the
+ * same sections as this run would write.
+ *
+ * @param[in] changed true if any plugin group was written
+ *
+ * @return true if the database does not need to be written
+ */
+static bool chk_cmds_db_current(bool changed)
+{
+     char fname[MAX_FILE_PATH_LEN];
+     char * path;
+     struct stat details;
+     int res;
+
+     if(changed || !g_prevManifest ||
+                              (g_prevManifest->numPlugins != g_numDbSections))
+     {
+          return false;
+     }
+
+     path = get_cache_dir();
+     snprintf(fname, sizeof(fname), "%s/%s", path, CMDS_DB_FILE);
+     res = stat(fname, &details);
+     free(path);
+     return res == 0;
+}
+
 /**
  * Write the plugin data to some post cached config files so that mozplugger
- * can be quick.
+ * can be quick. If the files are as the previous run left them they are not
+ * touched, so the browser does not see the plugin as changed.
  *
  * @param[in] localPluginDir The local(user) directory where plugins live.
  * @param[in] plugin The plugin config tree.
  * @param[in] cfgIdx The config tree idx.
  * @param[in] pluginIdx The plugin idx.
+ *
+ * @return true if the files were written
  */
-static void write_plugin(const char * config_fname, const char * localPluginDir, pluginType_t * plugin, int cfgIdx, int pluginIdx)
+static bool write_plugin(const char * config_fname, const char * localPluginDir, pluginType_t * plugin, int cfgIdx, int pluginIdx)
 {
      FILE * fp1;
      FILE * fp2;
      handler_t * handler;
      char buffer[MAX_FILE_PATH_LEN];
-     char * path = get_cache_dir();
+     char tmpName[MAX_FILE_PATH_LEN];
+     char cmdsName[MAX_FILE_PATH_LEN];
+     char * path;
+     char * desc = get_mimetypes_desc(plugin);
+     uint64_t digest;
+
+     add_cmds_db_section(plugin, cfgIdx);
+     digest = get_group_digest(config_fname, localPluginDir, plugin, cfgIdx,
+                                                              pluginIdx, desc);
+     add_manifest_plugin(plugin, cfgIdx, desc, digest);
+
+     if(chk_group_current(localPluginDir, cfgIdx, pluginIdx, digest))
+     {
+          LOG_INFO("Keeping %s/mozplugger%i.so ['%s' @ '%s']\n", localPluginDir,
+                                   pluginIdx, plugin->name, plugin->version);
+          return false;
+     }
 
      install(localPluginDir, cfgIdx, pluginIdx);
+     path = get_cache_dir();
 
      LOG_INFO("Creating %s ['%s' @ '%s']\n", localPluginDir, plugin->name, plugin->version);
 
+     /* The update may run in the background whilst the browser is reading
+      * these files, so they are all written under a temporary name and then
+      * renamed into place */
      snprintf(buffer, sizeof(buffer), "%s/%i.helpers", path, cfgIdx);
-     if(!(fp1 = fopen(buffer, "wb")))
+     snprintf(tmpName, sizeof(tmpName), "%s/%i.helpers.tmp", path, cfgIdx);
+     if(!(fp1 = fopen(tmpName, "wb")))
      {
-          ERROR("Failed to open '%s'\n", buffer);
+          ERROR("Failed to open '%s'\n", tmpName);
      }
      fprintf(fp1, "#%s\n", VERSION);
      fprintf(fp1, "# This is autogenerated from %s\n", config_fname);
@@ -1576,16 +3190,23 @@ static void write_plugin(const char * config_fname, const char * localPluginDir,
      fprintf(fp1, "%s\t%s\n", "version", plugin->version);
      write_helpers(fp1);
      fclose(fp1);
+     if(rename(tmpName, buffer) != 0)
+     {
+          ERROR("Failed to rename '%s'\n", tmpName);
+     }
 
-     snprintf(buffer, sizeof(buffer), "%s/%i.mimetypes", path, cfgIdx);
-     if(!(fp1 = fopen(buffer, "wb")))
+     snprintf(tmpName, sizeof(tmpName), "%s/%i.mimetypes.tmp", path, cfgIdx);
+     if(!(fp1 = fopen(tmpName, "wb")))
      {
-          ERROR("Failed to open '%s'\n", buffer);
+          ERROR("Failed to open '%s'\n", tmpName);
      }
      fprintf(fp1, "#%s\n", VERSION);
      fprintf(fp1, "# This is autogenerated from %s\n", config_fname);
 
-     snprintf(buffer, sizeof(buffer), "%s/%i.cmds", path, cfgIdx);
+     /* The plugin also keeps the cmds file open and reads commands from it
+      * when first needed */
+     snprintf(cmdsName, sizeof(cmdsName), "%s/%i.cmds", path, cfgIdx);
+     snprintf(buffer, sizeof(buffer), "%s/%i.cmds.tmp", path, cfgIdx);
      if(!(fp2 = fopen(buffer, "wb")))
      {
           fclose(fp1);
@@ -1594,14 +3215,26 @@ static void write_plugin(const char * config_fname, const char * localPluginDir,
      fprintf(fp2, "#%s\n", VERSION);
      fprintf(fp2, "# This is autogenerated from %s\n", config_fname);
 
+     fputs(desc, fp1);
      for(handler = plugin->handlers; handler; handler = handler->pNext)
      {
-         write_handler(handler, fp1, fp2);
+         write_handler(handler, fp2);
      }
 
      fclose(fp2);
      fclose(fp1);
+     if(rename(buffer, cmdsName) != 0)
+     {
+          ERROR("Failed to rename '%s'\n", buffer);
+     }
+     snprintf(buffer, sizeof(buffer), "%s/%i.mimetypes", path, cfgIdx);
+     if(rename(tmpName, buffer) != 0)
+     {
+          ERROR("Failed to rename '%s'\n", tmpName);
+     }
+
      free(path);
+     return true;
 }
 
 /**
@@ -1695,6 +3328,7 @@ int main(int argc, char * argv[])
      };
 
      const char * home = get_home_dir();
+     bool changed = false;
      int i;
      int cfgIndex = 0;
 
@@ -1711,6 +3345,8 @@ int main(int argc, char * argv[])
           ERROR("HOME not defined\n");
      }
 
+     g_prevManifest = read_prev_manifest();
+
 //     g_verbose = 1;
      for(i = 0; i < sizeof(browsers)/sizeof(browser_t); i++)
      {
@@ -1722,10 +3358,13 @@ int main(int argc, char * argv[])
 
           snprintf(localPluginDir, sizeof(localPluginDir), browsers[i].localPluginDir, home);
 
+          /* Recorded so that a browser installed later is noticed */
           if( (mkdir(localPluginDir, S_IRWXU) != 0) && (errno != EEXIST))
           {
+               add_manifest_dir_of(localPluginDir);
                continue;
           }
+          add_manifest_dir_of(localPluginDir);
 
           if(!(config_fname = find_helper_file(browsers[i].cfgPaths, "mozpluggerrc")))
           {
@@ -1734,26 +3373,44 @@ int main(int argc, char * argv[])
 
           LOG_INFO("Creating plugins for '%s'\n", localPluginDir);
 
-          plugins = trim(do_read_config(config_fname));
+          add_manifest_source(config_fname);
+          plugins = get_config(config_fname);
 
           for(plugin = plugins; plugin ; plugin = plugin->pNext)
           {
-               write_plugin(config_fname, localPluginDir, plugin, cfgIndex++, pluginIdx++);
+               if(write_plugin(config_fname, localPluginDir, plugin, cfgIndex++, pluginIdx++))
+               {
+                    changed = true;
+               }
           }
 
           free(config_fname);
+          removeRest(localPluginDir, pluginIdx);
+     }
 
+     for(i = 0; i < g_numParsedConfigs; i++)
+     {
+          pluginType_t * plugins = g_parsedConfigs[i].plugins;
           while(plugins)
           {
               pluginType_t * plugin = plugins;
               plugins = plugin->pNext;
               delete_plugin(plugin);
           }
-          removeRest(localPluginDir, pluginIdx);
      }
+     free(g_parsedConfigs);
 
+     if(chk_cmds_db_current(changed))
+     {
+          delete_cmds_db_sections();
+     }
+     else
+     {
+          write_cmds_db();
+     }
+     write_manifest();
+     free(g_prevManifest);
      delete_cache();
 
      return EXIT_SUCCESS;
 }
-
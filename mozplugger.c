@@ -32,8 +32,12 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <time.h>
 #include <utime.h>
 
@@ -59,6 +63,11 @@
 #include "cmd_flags.h"
 #include "scriptable_obj.h"
 #include "pipe_msg.h"
+#include "cmds_db.h"
+#include "plugin_name.h"
+#include "plugin_entry.h"
+#include "npp_attrs.h"
+#include "npp_attrs_tab.h"
 
 #ifndef __GNUC__
 #define __inline
@@ -66,19 +75,27 @@
 
 #define AUTO_UPDATE
 #define CHUNK_SIZE (8192)
+#define SPOOL_SIZE (256*1024)
+#define WRITE_READY_PERIOD_US (100000)
+#define WRITE_READY_DIVISOR (100)
+#define DEFAULT_PROGRESS_RATE (10)
+#define PROGRESSIVE_START_BYTES (1024*1024)
+#define PROGRESSIVE_START_PERCENT (10)
+#define DEFAULT_PLUGIN_NAME "MozPlugger dummy Plugin"
+#define CMD_CACHE_SIZE (16)
+#define INTERN_HASH_SIZE (1024)
+#define CMD_CACHE_MAX_SUFFIX (32)
+#define UPDATE_LOCK_STALE (10*60)
 
 /**
- * Element of linked list of commands created when parsing config file
+ * Command, mimetype and handler records are those of the commands database
+ * (see cmds_db.h), either mapped from CMDS_DB_FILE or built from N.cmds
  */
-typedef struct command
-{
-     int flags;
-     const char * cmd;
-     const char * winname;
-     const char * fmatchStr;
+typedef db_command_t command_t;
+typedef db_mimetype_t mimetype_t;
+typedef db_handler_t handler_t;
 
-     struct command * pNext;
-} command_t;
+#define DB_STR(ref) ((const char *) DB_DEREF(ref))
 
 
 /**
@@ -103,60 +120,181 @@ typedef struct data
      pid_t pid;
      int commsPipeFd;
      int repeats;
-     command_t * command;     /**< command to execute */
+     const command_t * command; /**< command to execute */
      unsigned int mode_flags; /**< flags associated with browser calls */
      char *mimetype;
      char *href;               /**< If QT this is set to handle special case */
      char *url;                /**< The URL */
+     char *urlLower;           /**< Lower case copy of url for fmatch */
+     int urlPathLen;           /**< Length of url before any '?' or '#' */
      char browserCantHandleIt; /**< Is set if browser cant handle protocol */
      char *urlFragment;
 
      int tmpFileFd;     /**< File descriptor of temp file */
      const char * tmpFileName; /**< Name of the temp file */
-     int tmpFileSize;   /**< Size of temp file so far */
+     int tmpFileSize;   /**< Size of temp file (or data piped) so far */
+     char * spool;      /**< Data not yet written to temp file */
+     int spoolLen;      /**< Amount of data in the spool */
+     int32_t writeReady; /**< Amount to ask for in NPP_WriteReady */
+     struct timeval rateStart; /**< Start of throughput measurement */
+     int rateBytes;     /**< Bytes received since rateStart */
+     long progressInterval; /**< Min microseconds between progress msgs */
+     struct timeval progressTime; /**< When last progress msg was sent */
+     int progressBytes; /**< File size in the last progress msg */
+     int progressiveStart; /**< File size to start a progressive helper */
+     int stdinFd;       /**< Pipe to the helper's stdin */
 
      char autostart;
      char autostartNotSeen;
      int num_arguments;
      struct argument *args;
+     struct plugin_cfg * cfg;  /**< Plugin group of the instance */
 } data_t;
 
 /**
- * Element of linked list of mimetypes created when parsing config file
+ * Entry in the mimetype hash index, lists in config order the handlers
+ * that have this mimetype (matched case insensitively)
  */
-typedef struct mimetype
+typedef struct mime_index
 {
-     const char * type;
+     const char * type;         /**< In lower case */
+     uint32_t hash;
+     int len;
+     int numHandlers;
+     int * handlers;            /**< Indexes into g_cfg->handlers, ascending */
+     struct mime_index * next;
+} mime_index_t;
 
-     struct mimetype * pNext;
-} mimetype_t;
+/**
+ * Node of a fmatch automaton, the nodes form a trie of the lower case
+ * patterns with the Aho-Corasick failure links added. Node zero is the root.
+ */
+typedef struct fmatch_node
+{
+     int child;                 /**< First child or zero */
+     int sibling;               /**< Next sibling or zero */
+     int fail;                  /**< Node of the longest proper suffix */
+     int dict;                  /**< Nearest node on fail chain with out */
+     int out;                   /**< First command ending here or -1 */
+     unsigned char c;
+} fmatch_node_t;
 
 /**
- * Element of linked list of handlers created when parsing config file
+ * Per command information for the fmatch automaton
  */
-typedef struct handle
+typedef struct fmatch_cmd
 {
-     mimetype_t * types;
-     command_t * cmds;
+     const char * pat;          /**< The pattern, without the '*' or '%' */
+     int next;                  /**< Next command with same pattern or -1 */
+     int len;                   /**< Length of the pattern */
+     unsigned seen;             /**< Generation in which the pattern matched */
+     int kind;                  /**< DB_FMATCH_xxx */
+} fmatch_cmd_t;
+
+/**
+ * The fmatch automaton of a handler, finds which of the fmatch patterns of
+ * all the commands of a handler match a URL in one pass over the URL.
+ */
+typedef struct fmatch
+{
+     fmatch_node_t * nodes;
+     fmatch_cmd_t * cmds;       /**< Indexed as the handler's commands */
+} fmatch_t;
+
+/**
+ * Entry of the command cache, remembers the result of find_command() along
+ * with all the inputs that the result depended on.
+ */
+typedef struct cmd_cache
+{
+     const mime_index_t * type; /**< Mimetype, NULL if in no handler */
+     unsigned ctx;              /**< Lookup context */
+     char used;
+     char shortPath;            /**< URL path shorter than suffixLen */
+     int suffixLen;             /**< URL suffix length result depends on */
+     int tailLen;               /**< Length of tail */
+     char tail[CMD_CACHE_MAX_SUFFIX]; /**< Lower case URL path tail */
+     unsigned lastUsed;
+     const command_t * command;
+} cmd_cache_t;
+
+/**
+ * Header at the start of each chunk of the static memory arena
+ */
+typedef struct arena_chunk
+{
+     struct arena_chunk * next; /**< Previously allocated chunk */
+     size_t size;               /**< Size of chunk including this header */
+     size_t used;               /**< Bytes used including this header */
+} arena_chunk_t;
+
+/**
+ * Entry of the table of interned strings, the string follows the entry
+ */
+typedef struct intern_str
+{
+     struct intern_str * next;
+     unsigned hash;
+     int len;
+} intern_str_t;
+
+/**
+ * The config of a plugin group. The plugin groups installed by
+ * mozplugger-update can all be stubs that share this one copy of the plugin
+ * (see plugin_stub.c), so each group is told apart by its magic and has its
+ * own config. Everything allocated for the group is in its own arena.
+ */
+typedef struct plugin_cfg
+{
+     struct plugin_cfg * next;
+     char magic[MAX_PLUGIN_MAGIC_LEN];
+
+     const handler_t * handlers;
+     int numHandlers;
+
+     mime_index_t ** mimeIndex;
+     unsigned mimeIndexMask;
+     int * wildHandlers;        /**< Handlers with the '*' mimetype */
+     int numWildHandlers;
+
+     fmatch_t ** fmatch;        /**< Indexed as handlers */
+     char * handlerReady;       /**< Indexed as handlers */
+     long * cmdsOffsets;        /**< Where in N.cmds handler cmds are */
+     FILE * cmdsFile;           /**< N.cmds whilst cmds parsed lazily */
 
-     struct handle * pNext;
-} handler_t;
+     cmd_cache_t cmdCache[CMD_CACHE_SIZE];
+     unsigned cmdCacheClock;
+
+     void * cmdsDb;             /**< The mapped CMDS_DB_FILE (if used) */
+     size_t cmdsDbLen;
+
+     const char * pluginName;
+     const char * version;
+     const char * linker;
+     const char * controller;
+     const char * helper;
+
+     arena_chunk_t * arena;     /**< Most recent chunk first */
+     intern_str_t ** internTable;
+} plugin_cfg_t;
 
 /**
  * Global variables
  */
 
 static char errMsg[512] = {0};
-static handler_t * g_handlers = 0;
 
-static const char * g_pluginName = "MozPlugger dummy Plugin";
-static const char * g_version = VERSION;
-static const char * g_linker = NULL;
-static const char * g_controller = NULL;
-static const char * g_helper = NULL;
+static plugin_cfg_t * g_cfgs = NULL; /**< The plugin groups in use */
+static plugin_cfg_t * g_cfg = NULL;  /**< The plugin group being called */
+
+static unsigned g_fmatchGen = 0;
 
-static char staticPool[MAX_STATIC_MEMORY_POOL];
-static int staticPoolIdx = 0;
+static unsigned g_cmdCacheHits = 0;
+static unsigned g_cmdCacheMisses = 0;
+
+static const manifest_header_t * g_manifest = NULL; /**< The mapped MANIFEST_FILE */
+static bool g_manifestStale = false;
+static struct stat g_manifestDetails; /**< Of the mapped MANIFEST_FILE */
 
 /**
  * Wrapper for putenv(). Instead of writing to the envirnoment, the envirnoment
@@ -284,36 +422,127 @@ static bool haveError(void)
 }
 
 /**
- * Allocate some memory from the static pool. We use a static pool for
- * the database because Mozilla can unload the plugin after use and this
- * would lead to memory leaks if we use the heap.
+ * Allocate some memory from the static arena. We use an arena of mmap'ed
+ * chunks for the database rather than the heap because Mozilla can unload
+ * the plugin after use and this would lead to memory leaks if we use the
+ * heap. The arena grows a chunk at a time and is only released as a whole by
+ * freeStaticMem().
+ *
+ * The memory is aligned so that records can be accessed directly.
  *
  * @param[in] size The size of the memory to allocate
  *
  * @return Pointer to the memory allocated or NULL
  */
-static void * allocStaticMem(int size)
+static void * allocStaticMem(size_t size)
 {
-     void * retVal = NULL;
-     const int newIdx = staticPoolIdx + size;
+     arena_chunk_t * chunk = g_cfg->arena;
+     size_t offset = 0;
 
-     if(newIdx > MAX_STATIC_MEMORY_POOL)
+     if(chunk)
      {
-          reportError(NULL, "MozPlugger: config file is too big - delete some handlers/commands or mimetypes");
+          offset = CMDS_DB_ALIGN(chunk->used);
      }
-     else
+
+     if(!chunk || (offset + size > chunk->size))
      {
-          retVal = &staticPool[staticPoolIdx];
-          staticPoolIdx = newIdx;
+          const size_t hdrSize = CMDS_DB_ALIGN(sizeof(arena_chunk_t));
+          const size_t pageSize = getpagesize();
+          size_t chunkSize = STATIC_MEMORY_CHUNK_SIZE;
+          void * mem;
+
+          if(hdrSize + size > chunkSize)
+          {
+               chunkSize = (hdrSize + size + pageSize - 1) & ~(pageSize - 1);
+          }
+
+          mem = mmap(NULL, chunkSize, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+          if(mem == MAP_FAILED)
+          {
+               reportError(NULL, "MozPlugger: failed to allocate memory for config");
+               return NULL;
+          }
+          chunk = mem;
+          chunk->next = g_cfg->arena;
+          chunk->size = chunkSize;
+          g_cfg->arena = chunk;
+          offset = hdrSize;
+          D("Static memory chunk %p allocated, size=%lu\n", mem,
+                                                     (unsigned long) chunkSize);
+     }
+
+     chunk->used = offset + size;
+     return (char *) chunk + offset;
+}
+
+/**
+ * Allocate a zeroed table of records from the static arena, aligned so the
+ * records can be accessed directly.
+ *
+ * @param[in] count The number of records
+ * @param[in] size The size of each record
+ *
+ * @return Pointer to the table or NULL
+ */
+static void * allocStaticTable(int count, int size)
+{
+     void * table;
+
+     if((table = allocStaticMem((size_t) count * size)) != NULL)
+     {
+          memset(table, 0, (size_t) count * size);
+     }
+     return table;
+}
+
+/**
+ * Get how much of the static arena is in use.
+ *
+ * @param[out] pUsed Set to the number of bytes used
+ * @param[out] pSize Set to the number of bytes mapped
+ *
+ * @return The number of chunks
+ */
+static int getStaticMemUsage(size_t * pUsed, size_t * pSize)
+{
+     const arena_chunk_t * chunk;
+     int numChunks = 0;
+
+     *pUsed = 0;
+     *pSize = 0;
+     for(chunk = g_cfg->arena; chunk; chunk = chunk->next)
+     {
+          *pUsed += chunk->used;
+          *pSize += chunk->size;
+          numChunks++;
+     }
+     return numChunks;
+}
+
+/**
+ * Release the whole of the static arena, everything allocated from it must
+ * no longer be referenced.
+ */
+static void freeStaticMem(void)
+{
+     g_cfg->internTable = NULL;
+     while(g_cfg->arena)
+     {
+          arena_chunk_t * const chunk = g_cfg->arena;
+          g_cfg->arena = chunk->next;
+          munmap(chunk, chunk->size);
      }
-     return retVal;
 }
 
 /**
  * Make a dynamic string static by copying to static memory.
  * Given a pointer to a string in temporary memory, return the same string
  * but this time stored in permanent (i.e. static) memory. Will only be deleted
- * when the plugin is unloaded by Mozilla.
+ * when the plugin is unloaded by Mozilla. The strings are interned, as the
+ * config is generated by m4 macros the same strings are repeated many times
+ * and identical strings share the one copy (and so can be compared by
+ * pointer).
  *
  * @param[in] str Pointer to the string
  * @param[in] len The length of the string
@@ -322,14 +551,51 @@ static void * allocStaticMem(int size)
  */
 static const char * makeStrStatic(const char * str, int len)
 {
-     /* plus one for string terminator */
-     char * const buf = allocStaticMem(len + 1);
+     unsigned hash = 2166136261u;
+     intern_str_t ** pBucket;
+     intern_str_t * entry;
+     char * buf;
+     int i;
+
+     if(!g_cfg->internTable)
+     {
+          g_cfg->internTable = allocStaticTable(INTERN_HASH_SIZE,
+                                                      sizeof(intern_str_t *));
+          if(!g_cfg->internTable)
+          {
+               return NULL;
+          }
+     }
+
+     for(i = 0; i < len; i++)
+     {
+          hash = (hash ^ (unsigned char) str[i]) * 16777619u;
+     }
+
+     pBucket = &g_cfg->internTable[hash & (INTERN_HASH_SIZE - 1)];
+     for(entry = *pBucket; entry; entry = entry->next)
+     {
+          buf = (char *) &entry[1];
+          if((entry->hash == hash) && (entry->len == len) &&
+                                          (memcmp(buf, str, len) == 0))
+          {
+               return buf;
+          }
+     }
 
-     if(buf)
+     /* plus one for string terminator */
+     entry = allocStaticTable(1, sizeof(intern_str_t) + len + 1);
+     if(!entry)
      {
-          strncpy(buf, str, len);
-          buf[len] = '\0';
+          return NULL;
      }
+     buf = (char *) &entry[1];
+     memcpy(buf, str, len);
+     buf[len] = '\0';
+     entry->hash = hash;
+     entry->len = len;
+     entry->next = *pBucket;
+     *pBucket = entry;
      return buf;
 }
 
@@ -375,6 +641,41 @@ static bool is_base_mozplugger(const char * magic)
      return (magic[0] == '-');
 }
 
+/**
+ * Make the plugin group with this magic the one being called, creating the
+ * group's config the first time it is called.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return false if run out of memory
+ */
+static bool select_cfg(const char * magic)
+{
+     plugin_cfg_t * cfg;
+
+     for(cfg = g_cfgs; cfg; cfg = cfg->next)
+     {
+          if(strncmp(cfg->magic, magic, sizeof(cfg->magic)) == 0)
+          {
+               g_cfg = cfg;
+               return true;
+          }
+     }
+
+     if((cfg = calloc(1, sizeof(plugin_cfg_t))) == NULL)
+     {
+          reportError(NULL, "MozPlugger: failed to allocate memory for config");
+          return false;
+     }
+     strncpy(cfg->magic, magic, sizeof(cfg->magic) - 1);
+     cfg->pluginName = DEFAULT_PLUGIN_NAME;
+     cfg->version = VERSION;
+     cfg->next = g_cfgs;
+     g_cfgs = cfg;
+     g_cfg = cfg;
+     return true;
+}
+
 /**
  * Get the home directory
  *
@@ -444,6 +745,169 @@ static int get_cfg_path_prefix(const char * magic, char * buf, int bufLen)
      return snprintf(buf, bufLen, fmt, home, prefixLen, magic);
 }
 
+/**
+ * Check the mapped manifest is valid before using it.
+ *
+ * @param[in] image The mapped image
+ * @param[in] len The size of the image
+ *
+ * @return true if valid
+ */
+static bool chk_manifest(const void * image, size_t len)
+{
+#define IN_IMAGE(ref, size) \
+     (((const char *) DB_DEREF(ref) >= (const char *) image) \
+      && ((const char *) DB_DEREF(ref) + (size) <= (const char *) image + len))
+
+     const manifest_header_t * hdr = image;
+     const manifest_source_t * src;
+     const manifest_plugin_t * plugin;
+     unsigned i;
+
+     if((len < sizeof(manifest_header_t))
+             || (memcmp(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic)) != 0)
+             || (hdr->format != MANIFEST_FORMAT) || (hdr->size != len)
+             || (strncmp(hdr->version, VERSION, sizeof(hdr->version)) != 0))
+     {
+          D("Manifest format or version mismatch\n");
+          return false;
+     }
+
+     /* As in the commands database all strings are at the end */
+     if((((const char *) image)[len - 1] != '\0')
+             || !IN_IMAGE(hdr->sources, hdr->numSources * sizeof(manifest_source_t))
+             || !IN_IMAGE(hdr->plugins, hdr->numPlugins * sizeof(manifest_plugin_t))
+             || (hdr->linker && !IN_IMAGE(hdr->linker, 1))
+             || (hdr->controller && !IN_IMAGE(hdr->controller, 1))
+             || (hdr->helper && !IN_IMAGE(hdr->helper, 1)))
+     {
+          D("Manifest is corrupt\n");
+          return false;
+     }
+
+     for(i = 0, src = DB_DEREF(hdr->sources); i < hdr->numSources; i++, src++)
+     {
+          if(!IN_IMAGE(src->path, 1))
+          {
+               return false;
+          }
+     }
+     for(i = 0, plugin = DB_DEREF(hdr->plugins); i < hdr->numPlugins; i++, plugin++)
+     {
+          if(!IN_IMAGE(plugin->name, 1) || !IN_IMAGE(plugin->version, 1)
+                                        || !IN_IMAGE(plugin->mimetypes, 1))
+          {
+               return false;
+          }
+     }
+     return true;
+#undef IN_IMAGE
+}
+
+/**
+ * Check none of the inputs the manifest was generated from have changed
+ * since. As every input that the outputs depend on is recorded there is
+ * no need for a periodic refresh.
+ *
+ * @param[in] hdr The manifest
+ *
+ * @return true if the manifest is up to date
+ */
+static bool chk_manifest_is_current(const manifest_header_t * hdr)
+{
+     const manifest_source_t * src = DB_DEREF(hdr->sources);
+     unsigned i;
+
+     for(i = 0; i < hdr->numSources; i++, src++)
+     {
+          const char * const path = DB_STR(src->path);
+          struct stat details;
+          bool changed;
+
+          if(!path)
+          {
+               return false;
+          }
+          if(stat(path, &details) != 0)
+          {
+               changed = !(src->flags & MANIFEST_SRC_MISSING);
+          }
+          else
+          {
+               changed = (src->flags & MANIFEST_SRC_MISSING)
+                  || (details.st_dev != src->dev) || (details.st_ino != src->ino)
+                  || (details.st_mtime != src->mtime)
+                  || (details.st_size != src->size);
+          }
+          if(changed)
+          {
+               D("Manifest input %s has changed\n", path);
+               return false;
+          }
+     }
+     return true;
+}
+
+/**
+ * Get this plugin group's entry in the manifest written by mozplugger-update,
+ * mapping the manifest the first time. The manifest is checked when mapped
+ * and after that only for being replaced (see chk_manifest_replaced()), so
+ * the browser calling NP_GetValue() and NP_GetPluginVersion() costs no more
+ * file accesses.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return Pointer to the entry or NULL if no usable manifest
+ */
+static const manifest_plugin_t * get_manifest_plugin(const char * magic)
+{
+     const int cfgIdx = is_base_mozplugger(magic) ? 0 : atoi(magic);
+
+     if(!g_manifest)
+     {
+          char fname[200];
+          struct stat details;
+          void * image;
+          int fd;
+
+          get_cfg_path_prefix(MANIFEST_FILE ":", fname, sizeof(fname));
+          if((fd = open(fname, O_RDONLY)) < 0)
+          {
+               D("No manifest %s\n", fname);
+               return NULL;
+          }
+          if((fstat(fd, &details) != 0) || (details.st_size < sizeof(manifest_header_t)))
+          {
+               close(fd);
+               return NULL;
+          }
+
+          /* Like the commands database it is replaced by renaming */
+          image = mmap(NULL, details.st_size, PROT_READ, MAP_SHARED, fd, 0);
+          close(fd);
+          if(image == MAP_FAILED)
+          {
+               D("Failed to map %s, errno=%i\n", fname, errno);
+               return NULL;
+          }
+          if(!chk_manifest(image, details.st_size))
+          {
+               munmap(image, details.st_size);
+               return NULL;
+          }
+          g_manifest = image;
+          g_manifestDetails = details;
+          g_manifestStale = !chk_manifest_is_current(g_manifest);
+     }
+
+     if((cfgIdx < 0) || ((unsigned) cfgIdx >= g_manifest->numPlugins))
+     {
+          D("No plugin %d in manifest\n", cfgIdx);
+          return NULL;
+     }
+     return (const manifest_plugin_t *) DB_DEREF(g_manifest->plugins) + cfgIdx;
+}
+
 /**
  * Get the paths to the mozplugger helpers.
  *
@@ -457,9 +921,21 @@ static void get_helper_paths(const char * magic)
      FILE * fp;
      int n;
 
-     if(g_controller || g_linker || g_helper)
+     const manifest_plugin_t * plugin;
+
+     if(g_cfg->controller || g_cfg->linker || g_cfg->helper)
          return;
 
+     if((plugin = get_manifest_plugin(magic)) != NULL)
+     {
+          g_cfg->linker = DB_STR(g_manifest->linker);
+          g_cfg->controller = DB_STR(g_manifest->controller);
+          g_cfg->helper = DB_STR(g_manifest->helper);
+          g_cfg->version = DB_STR(plugin->version);
+          g_cfg->pluginName = DB_STR(plugin->name);
+          return;
+     }
+
      n = get_cfg_path_prefix(magic, fname, sizeof(fname));
      strncat(fname, ".helpers", sizeof(fname) - n);
 
@@ -475,23 +951,23 @@ static void get_helper_paths(const char * magic)
                     *sep = '\0';
                     if(strcmp(buffer, "linker") == 0)
                     {
-                         g_linker = makeStrStatic(&sep[1], pathLen);
+                         g_cfg->linker = makeStrStatic(&sep[1], pathLen);
                     }
                     else if(strcmp(buffer, "controller") == 0)
                     {
-                         g_controller = makeStrStatic(&sep[1], pathLen);
+                         g_cfg->controller = makeStrStatic(&sep[1], pathLen);
                     }
                     else if(strcmp(buffer, "version") == 0)
                     {
-                         g_version = makeStrStatic(&sep[1], pathLen);
+                         g_cfg->version = makeStrStatic(&sep[1], pathLen);
                     }
                     else if(strcmp(buffer, "name") == 0)
                     {
-                         g_pluginName = makeStrStatic(&sep[1], pathLen);
+                         g_cfg->pluginName = makeStrStatic(&sep[1], pathLen);
                     }
                     else if(strcmp(buffer, "helper") == 0)
                     {
-                         g_helper = makeStrStatic(&sep[1], pathLen);
+                         g_cfg->helper = makeStrStatic(&sep[1], pathLen);
                     }
                }
           }
@@ -499,6 +975,69 @@ static void get_helper_paths(const char * magic)
      }
 }
 
+/**
+ * Check if mozplugger-update has replaced the manifest since it was mapped
+ * and if so drop the old one, so that the browser keeping mozplugger loaded
+ * between plugin rescans still gets the new descriptions and a refresh is
+ * not started again once it is done. The helper paths, name and version of
+ * the plugin groups that point into the old manifest are looked up again.
+ *
+ * @return None
+ */
+static void chk_manifest_replaced(void)
+{
+#define IN_OLD(p) (((const char *)(p) >= start) && ((const char *)(p) < end))
+     const manifest_header_t * const old = g_manifest;
+     const char * start;
+     const char * end;
+     plugin_cfg_t * const saved = g_cfg;
+     plugin_cfg_t * cfg;
+     char fname[200];
+     struct stat details;
+
+     if(!old)
+     {
+          return;
+     }
+
+     get_cfg_path_prefix(MANIFEST_FILE ":", fname, sizeof(fname));
+     if((stat(fname, &details) == 0)
+          && (details.st_dev == g_manifestDetails.st_dev)
+          && (details.st_ino == g_manifestDetails.st_ino)
+          && (details.st_mtime == g_manifestDetails.st_mtime)
+          && (details.st_size == g_manifestDetails.st_size))
+     {
+          return;
+     }
+
+     D("Manifest %s has been replaced\n", fname);
+     g_manifest = NULL;
+     g_manifestStale = false;
+
+     start = (const char *) old;
+     end = start + old->size;
+     for(cfg = g_cfgs; cfg; cfg = cfg->next)
+     {
+          if(IN_OLD(cfg->linker) || IN_OLD(cfg->controller)
+               || IN_OLD(cfg->helper) || IN_OLD(cfg->pluginName)
+               || IN_OLD(cfg->version))
+          {
+               cfg->linker = NULL;
+               cfg->controller = NULL;
+               cfg->helper = NULL;
+               cfg->pluginName = DEFAULT_PLUGIN_NAME;
+               cfg->version = VERSION;
+
+               g_cfg = cfg;
+               get_helper_paths(cfg->magic);
+          }
+     }
+     g_cfg = saved;
+
+     munmap((void *) old, old->size);
+#undef IN_OLD
+}
+
 /**
  * Get the path to the configuration file.
  *
@@ -610,7 +1149,7 @@ static void run(data_t * const THIS, const char *file, int pipeFd)
                                             "autostart", autostart ? "1" : "0");
 
      offset = my_putenv(buffer, sizeof(buffer), offset,
-                                             "winname", THIS->command->winname);
+                                      "winname", DB_STR(THIS->command->winname));
 
      if(THIS->display)
      {
@@ -626,22 +1165,22 @@ static void run(data_t * const THIS, const char *file, int pipeFd)
 
      if(flags & H_CONTROLS)
      {
-          launcher = g_controller;
+          launcher = g_cfg->controller;
      }
      else if(flags & H_LINKS)
      {
-          launcher = g_linker;
+          launcher = g_cfg->linker;
      }
      else if(!autostart && !(flags & H_AUTOSTART) && (THIS->window != 0))
      {
           /* Application doesn't do autostart and autostart is false and
            * we have a window to draw in */
-	  nextHelper = g_helper;
-          launcher = g_linker;
+	  nextHelper = g_cfg->helper;
+          launcher = g_cfg->linker;
      }
      else
      {
-          launcher = g_helper;
+          launcher = g_cfg->helper;
      }
 
      if(launcher == 0)
@@ -654,10 +1193,10 @@ static void run(data_t * const THIS, const char *file, int pipeFd)
        launcher,
        buffer,
        file,
-       THIS->command->cmd,
+       DB_STR(THIS->command->cmd),
        THIS->mimetype);
 
-     execlp(launcher, launcher, buffer, THIS->command->cmd, nextHelper, NULL);
+     execlp(launcher, launcher, buffer, DB_STR(THIS->command->cmd), nextHelper, NULL);
 
      D("EXECLP FAILED! errno=%i\n", errno);
 
@@ -696,6 +1235,47 @@ static char * NP_strdup(const char * str)
      return NP_strdup2(str, strlen(str));
 }
 
+/**
+ * Set the URL of the instance, also keeps the normalised copy of the URL
+ * used for fmatch so that is only done once per URL.
+ *
+ * @param[in] THIS Pointer to the data associated with this instance of the
+ *                       plugin
+ * @param[in] url The URL or NULL
+ */
+static void set_url(data_t * THIS, char * url)
+{
+     if(THIS->urlLower)
+     {
+          NPN_MemFree(THIS->urlLower);
+          THIS->urlLower = NULL;
+     }
+     THIS->url = url;
+     THIS->urlPathLen = 0;
+
+     if(url && ((THIS->urlLower = NP_strdup(url)) != NULL))
+     {
+          const char * end;
+          char * p;
+
+          for(p = THIS->urlLower; *p; p++)
+          {
+               *p = tolower((unsigned char) *p);
+          }
+
+          /* fmatch suffixes are matched against the end of the url, before
+           * any extra params i.e'?=xxx' or '#yyy' */
+          if( (end = strchr(url, '?')) == NULL)
+          {
+               if( (end = strchr(url, '#')) == NULL)
+               {
+                    end = &url[strlen(url)];
+               }
+          }
+          THIS->urlPathLen = end - url;
+     }
+}
+
 
 /**
  * Test if the line buffer contains a mimetype
@@ -710,51 +1290,52 @@ static bool isCfgMimeType(char * buffer)
 }
 
 /**
- * Parse the mimetypec in the cfg file
+ * Parse the mimetype in the cfg file
  *
  * @param[in] buffer The line read from config file
+ * @param[out] type The mimetype record to fill in
  *
- * @return a mimetype_t structure if valid mimetype.
+ * @return false if run out of memory
  */
-static mimetype_t * parseCfgMimeType(char * buffer)
+static bool parseCfgMimeType(char * buffer, mimetype_t * type)
 {
-     mimetype_t * type = (mimetype_t *) allocStaticMem(sizeof(mimetype_t));
-     if(type == 0)
-     {
-          D("Failed to alloc memory for mimetype\n");
-          return NULL;
-     }
-     memset(type, 0, sizeof(mimetype_t));
+     const char * str;
+     uint32_t hash = DB_HASH_INIT;
+     int len;
 
      D("New mime type\n");
 
+     /* mozplugger-update has already put the mimetype in lower case */
+     for(len = 0; buffer[len]; len++)
+     {
+          hash = DB_HASH_STEP(hash, buffer[len]);
+     }
+     type->hash = hash;
+     type->len = len;
+     type->flags = (strcmp(buffer, "*") == 0) ? DB_MIMETYPE_ANY : 0;
+
      /* Cant use NPN_MemAlloc in NPP_GetMimeDescription, use
       * makeStrStatic as opposed to strdup otherwise we get a
       * memory leak */
-     type->type = makeStrStatic(buffer, strlen(buffer));
+     str = makeStrStatic(buffer, len);
+     DB_SETREF(type->type, str);
 
-     return (type->type == 0) ? NULL : type;
+     return (str != NULL);
 }
 
 /**
  * Parse the command found in the cfg file
  *
  * @param[in] buffer The line read from config file
+ * @param[out] cmd The command record to fill in
  *
- * @return a command structure if command found.
+ * @return false if run out of memory
  */
-static command_t * parseCfgCmdLine(char * buffer)
+static bool parseCfgCmdLine(char * buffer, command_t * cmd)
 {
      char * x = &buffer[1];
      char * sep;
-
-     command_t * cmd = (command_t *) allocStaticMem(sizeof(command_t));
-     if(cmd == NULL)
-     {
-           D("Failed to alloc memory for command\n");
-           return NULL;
-     }
-     memset(cmd, 0, sizeof(command_t));
+     const char * str;
 
      D("-- reading cmd line %s\n", x);
 
@@ -762,43 +1343,126 @@ static command_t * parseCfgCmdLine(char * buffer)
      cmd->flags = strtol(x, NULL, 16);
      x = &sep[1];
      sep = strchr(x, '\t');
+     cmd->accept = strtoul(x, NULL, 16);
+     x = &sep[1];
+     sep = strchr(x, '\t');
      if(sep > x)
      {
-          cmd->winname = makeStrStatic(x, sep - x);
+          str = makeStrStatic(x, sep - x);
+          DB_SETREF(cmd->winname, str);
      }
      x = &sep[1];
      sep = strchr(x, '\t');
      if( sep > x)
      {
-          cmd->fmatchStr = makeStrStatic(x, sep - x);
+          switch(*x)
+          {
+          case '*':
+               cmd->fmatchKind = DB_FMATCH_PREFIX;
+               x++;
+               break;
+          case '%':
+               cmd->fmatchKind = DB_FMATCH_SUFFIX;
+               x++;
+               break;
+          default:
+               cmd->fmatchKind = DB_FMATCH_SUBSTR;
+               break;
+          }
+          cmd->fmatchLen = sep - x;
+          str = makeStrStatic(x, sep - x);
+          DB_SETREF(cmd->fmatchStr, str);
      }
      x = &sep[1];
-     cmd->cmd = makeStrStatic(x, strlen(x));
-     return cmd;
+     str = makeStrStatic(x, strlen(x));
+     DB_SETREF(cmd->cmd, str);
+
+     return (str != NULL);
 }
 
 /**
- * Read the configuration file into memory.
+ * Allocate the tables that hold per handler state that is set up when the
+ * handler is first selected by find_command().
  *
- * @param[in] f The FILE pointer
+ * @param[in] numHandlers The number of handlers
+ *
+ * @return false if run out of memory
  */
-static void read_config(FILE * f)
+static bool alloc_handler_tables(int numHandlers)
 {
-     int num_handlers = 0;
+     g_cfg->fmatch = allocStaticTable(numHandlers, sizeof(fmatch_t *));
+     g_cfg->handlerReady = allocStaticTable(numHandlers, sizeof(char));
+     return g_cfg->fmatch && g_cfg->handlerReady;
+}
 
-     handler_t * prev_handler = NULL;
-     handler_t * handler = NULL;
+/**
+ * Read the configuration file into memory. Only the mimetypes are parsed,
+ * for the commands just the number of commands and where they are in the
+ * file is noted. The commands of a handler are parsed by load_handler_cmds()
+ * when the handler is first selected, as a browsing session only uses a
+ * few of the handlers. The file is read twice, first to count the records
+ * and then to fill in the tables so that the records end up in the same
+ * contiguous layout as in the binary database.
+ *
+ * @param[in] f The FILE pointer
+ */
+static void read_config(FILE * f)
+{
+     int numHandlers = 0;
+     int numTypes = 0;
+     bool hasCmds = false;
 
-     command_t * prev_cmd = NULL;
-     mimetype_t * prev_type = NULL;
+     handler_t * handlers;
+     mimetype_t * types;
+     long * offsets;
+     handler_t * handler = NULL;
+     mimetype_t * type;
 
      char lineBuf[512];
+     long offset;
      int lineNum;
 
      D("read_config\n");
 
-     lineNum = 0;
      while (fgets(lineBuf, sizeof(lineBuf), f))
+     {
+          if(!chkCfgLine(lineBuf))
+          {
+               continue;
+          }
+
+          if(isCfgMimeType(lineBuf))
+          {
+               if((numHandlers == 0) || hasCmds)
+               {
+                    numHandlers++;
+                    hasCmds = false;
+               }
+               numTypes++;
+          }
+          else
+          {
+               if(numHandlers == 0)
+               {
+                    D("Command before mimetype!\n");
+                    return;
+               }
+               hasCmds = true;
+          }
+     }
+
+     handlers = allocStaticTable(numHandlers, sizeof(handler_t));
+     types = allocStaticTable(numTypes, sizeof(mimetype_t));
+     offsets = allocStaticTable(numHandlers, sizeof(long));
+     if(!handlers || !types || !offsets || !alloc_handler_tables(numHandlers))
+     {
+          return; /* run out of memory! */
+     }
+     type = types;
+
+     rewind(f);
+     lineNum = 0;
+     for(offset = 0; fgets(lineBuf, sizeof(lineBuf), f); offset = ftell(f))
      {
           lineNum++;
           if(!chkCfgLine(lineBuf))
@@ -810,85 +1474,570 @@ static void read_config(FILE * f)
 
           if(isCfgMimeType(lineBuf))
 	  {
-	       /* Mime type */
-               mimetype_t * type = NULL;
+               if(type == &types[numTypes])
+               {
+                    break; /* File changed under our feet */
+               }
 
-	       if (!handler || handler->cmds)
+	       if (!handler || handler->numCmds)
 	       {
 		    D("------------ Starting new handler ---------\n");
 
-		    handler = (handler_t *) allocStaticMem(sizeof(handler_t));
-                    if(handler == 0)
+                    handler = handler ? &handler[1] : handlers;
+                    if(handler == &handlers[numHandlers])
                     {
-                         return;
+                         break;
                     }
-                    memset(handler, 0, sizeof(handler_t));
+                    DB_SETREF(handler->types, type);
+	       }
+
+               if(!parseCfgMimeType(lineBuf, type))
+               {
+                    return; /* run out of memory! */
+               }
+               handler->numTypes++;
+               type++;
+	  }
+	  else
+	  {
+               if(!handler)
+               {
+                    break;
+               }
+               if(handler->numCmds == 0)
+               {
+                    offsets[handler - handlers] = offset;
+               }
+               handler->numCmds++;
+          }
+     }
+
+     g_cfg->cmdsOffsets = offsets;
+     g_cfg->handlers = handlers;
+     g_cfg->numHandlers = handler ? (handler - handlers) + 1 : 0;
+     D("Num handlers: %d\n", g_cfg->numHandlers);
+}
+
+/**
+ * Check the mapped commands database is valid before using it. The records
+ * are used in place so check every reference points inside the image.
+ *
+ * @param[in] image The mapped image
+ * @param[in] len The size of the image
+ *
+ * @return true if valid
+ */
+static bool chk_cmds_db(const void * image, size_t len)
+{
+#define IN_IMAGE(ref, size) \
+     (((const char *) DB_DEREF(ref) >= (const char *) image) \
+      && ((const char *) DB_DEREF(ref) + (size) <= (const char *) image + len))
+
+     const db_header_t * hdr = image;
+     const handler_t * h;
+     unsigned i;
+
+     if((memcmp(hdr->magic, CMDS_DB_MAGIC, sizeof(hdr->magic)) != 0)
+             || (hdr->format != CMDS_DB_FORMAT) || (hdr->size != len)
+             || (strncmp(hdr->version, VERSION, sizeof(hdr->version)) != 0))
+     {
+          D("Commands database format or version mismatch\n");
+          return false;
+     }
+
+     /* All strings are at the end of the image, so a string that starts in
+      * the image must also end in the image */
+     if((((const char *) image)[len - 1] != '\0')
+             || !IN_IMAGE(hdr->handlers, hdr->numHandlers * sizeof(handler_t)))
+     {
+          D("Commands database is corrupt\n");
+          return false;
+     }
+
+     h = DB_DEREF(hdr->handlers);
+     for(i = 0; i < hdr->numHandlers; i++, h++)
+     {
+          const mimetype_t * m;
+          const command_t * c;
+          unsigned j;
+
+          if(!IN_IMAGE(h->types, h->numTypes * sizeof(mimetype_t))
+                  || !IN_IMAGE(h->cmds, h->numCmds * sizeof(command_t)))
+          {
+               D("Commands database handler %u is corrupt\n", i);
+               return false;
+          }
+          for(j = 0, m = DB_DEREF(h->types); j < h->numTypes; j++, m++)
+          {
+               if(!IN_IMAGE(m->type, m->len + 1))
+               {
+                    return false;
+               }
+          }
+          for(j = 0, c = DB_DEREF(h->cmds); j < h->numCmds; j++, c++)
+          {
+               if(!IN_IMAGE(c->cmd, 1)
+                       || (c->winname && !IN_IMAGE(c->winname, 1))
+                       || (c->fmatchStr && !IN_IMAGE(c->fmatchStr, c->fmatchLen + 1))
+                       || (!c->fmatchStr != (c->fmatchKind == DB_FMATCH_NONE))
+                       || (c->fmatchKind > DB_FMATCH_SUBSTR))
+               {
+                    return false;
+               }
+          }
+     }
+     return true;
+#undef IN_IMAGE
+}
+
+/**
+ * Find the section for this plugin group in the mapped commands database.
+ *
+ * @param[in] file The mapped file
+ * @param[in] len The size of the file
+ * @param[in] cfgIdx The plugin group
+ * @param[out] pSize Set to the size of the section
+ *
+ * @return Pointer to the section or NULL if none or the file is invalid
+ */
+static const void * find_cmds_db_section(const void * file, size_t len,
+                                                   int cfgIdx, size_t * pSize)
+{
+     const db_set_header_t * hdr = file;
+     const db_section_t * sections = (const db_section_t *) &hdr[1];
+     const db_section_t * section;
+
+     if((memcmp(hdr->magic, CMDS_DB_SET_MAGIC, sizeof(hdr->magic)) != 0)
+             || (hdr->format != CMDS_DB_FORMAT) || (hdr->size != len)
+             || (cfgIdx < 0) || ((unsigned) cfgIdx >= hdr->numSections)
+             || ((char *) &sections[hdr->numSections] > (char *) file + len))
+     {
+          D("Commands database format mismatch or no section %d\n", cfgIdx);
+          return NULL;
+     }
+
+     section = &sections[cfgIdx];
+     if((section->size < sizeof(db_header_t)) || (section->offset % 8 != 0)
+             || (section->offset > len) || (section->size > len - section->offset))
+     {
+          D("Commands database section %d is corrupt\n", cfgIdx);
+          return NULL;
+     }
+     *pSize = section->size;
+     return (const char *) file + section->offset;
+}
+
+/**
+ * Map the binary commands database written by mozplugger-update. The
+ * records are used in place so there is no parsing and no copying, the
+ * text N.cmds file is only read if this fails. The one file holds the
+ * config of all the plugin groups and is mapped shared by each copy of
+ * the plugin so only one copy of it is held in memory.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return true if the database was mapped
+ */
+static bool map_cmds_db(const char * magic)
+{
+     char fname[200];
+     struct stat details;
+     void * image;
+     const void * section;
+     size_t sectionLen;
+     char * sep;
+     int fd;
+
+     get_cfg_path_prefix(magic, fname, sizeof(fname));
+     if((sep = strrchr(fname, '/')) == NULL)
+     {
+          return false;
+     }
+     snprintf(&sep[1], sizeof(fname) - (&sep[1] - fname), "%s", CMDS_DB_FILE);
+
+     if((fd = open(fname, O_RDONLY)) < 0)
+     {
+          D("No commands database %s\n", fname);
+          return false;
+     }
+
+     if((fstat(fd, &details) != 0) || (details.st_size < sizeof(db_set_header_t)))
+     {
+          close(fd);
+          return false;
+     }
+
+     /* mozplugger-update replaces the file by renaming over it, so the
+      * mapping stays valid even if it is updated whilst we are running */
+     image = mmap(NULL, details.st_size, PROT_READ, MAP_SHARED, fd, 0);
+     close(fd);
+     if(image == MAP_FAILED)
+     {
+          D("Failed to map %s, errno=%i\n", fname, errno);
+          return false;
+     }
+
+     section = find_cmds_db_section(image, details.st_size,
+                            is_base_mozplugger(magic) ? 0 : atoi(magic), &sectionLen);
+     if(!section || !chk_cmds_db(section, sectionLen)
+          || !alloc_handler_tables(((const db_header_t *) section)->numHandlers))
+     {
+          munmap(image, details.st_size);
+          return false;
+     }
+
+     g_cfg->cmdsDb = image;
+     g_cfg->cmdsDbLen = details.st_size;
+     g_cfg->handlers = DB_DEREF(((const db_header_t *) section)->handlers);
+     g_cfg->numHandlers = ((const db_header_t *) section)->numHandlers;
+
+     D("Mapped %s, num handlers: %d\n", fname, g_cfg->numHandlers);
+     return true;
+}
+
+/**
+ * Case insensitive hash of a requested mimetype, the same as the hash of
+ * the lower case mimetypes in the config.
+ *
+ * @param[in] type The mimetype
+ * @param[out] pLen Set to the length of the mimetype
+ *
+ * @return The hash value
+ */
+static uint32_t hash_mime_type(const char * type, int * pLen)
+{
+     uint32_t hash = DB_HASH_INIT;
+     int len;
+
+     for(len = 0; type[len]; len++)
+     {
+          hash = DB_HASH_STEP(hash, tolower((unsigned char) type[len]));
+     }
+     *pLen = len;
+     return hash;
+}
+
+/**
+ * Look up a mimetype in the mimetype hash index.
+ *
+ * @param[in] type The mimetype
+ * @param[in] len The length of the mimetype
+ * @param[in] hash The hash of the mimetype
+ *
+ * @return Pointer to the index entry or NULL if none
+ */
+static mime_index_t * find_mime_index(const char * type, int len, uint32_t hash)
+{
+     mime_index_t * e = g_cfg->mimeIndex[hash & g_cfg->mimeIndexMask];
 
-                    prev_type = NULL;
-                    prev_cmd = NULL;
+     for(; e; e = e->next)
+     {
+          if((e->hash == hash) && (e->len == len) && (strcasecmp(e->type, type) == 0))
+          {
+               break;
+          }
+     }
+     return e;
+}
+
+/**
+ * Build the hash index from mimetype to the handlers that list that
+ * mimetype. Handlers with the '*' wildcard mimetype are kept in a separate
+ * list so find_command() can merge the two and preserve config file order.
+ * If the index cannot be built, find_command() falls back to a linear scan.
+ */
+static void build_mime_index(void)
+{
+     mime_index_t ** buckets;
+     mime_index_t * entries;
+     int * slots;
+     int numTypes = 0;
+     int numEntries = 0;
+     int numBuckets = 1;
+     int pass;
+     int i;
+
+     for(i = 0; i < g_cfg->numHandlers; i++)
+     {
+          numTypes += g_cfg->handlers[i].numTypes;
+     }
+     while(numBuckets < 2 * numTypes)
+     {
+          numBuckets <<= 1;
+     }
+
+     buckets = allocStaticTable(numBuckets, sizeof(mime_index_t *));
+     entries = allocStaticTable(numTypes, sizeof(mime_index_t));
+     slots = allocStaticTable(numTypes, sizeof(int));
+     if(!buckets || !entries || !slots)
+     {
+          return;
+     }
+     g_cfg->mimeIndex = buckets;
+     g_cfg->mimeIndexMask = numBuckets - 1;
+
+     /* First pass creates the entries and counts an upper bound of handlers
+      * per entry, the second pass fills in the handler lists */
+     for(pass = 0; pass < 2; pass++)
+     {
+          g_cfg->numWildHandlers = 0;
+          for(i = 0; i < g_cfg->numHandlers; i++)
+          {
+               const mimetype_t * m = DB_DEREF(g_cfg->handlers[i].types);
+               const mimetype_t * const mEnd = &m[g_cfg->handlers[i].numTypes];
+
+               for(; m < mEnd; m++)
+               {
+                    const char * type = DB_STR(m->type);
+                    int * list;
+                    int * pNum;
 
-                    if(prev_handler)
+                    if(m->flags & DB_MIMETYPE_ANY)
                     {
-                         /* Add to end of linked list of handlers */
-                         prev_handler->pNext = handler;
+                         list = g_cfg->wildHandlers;
+                         pNum = &g_cfg->numWildHandlers;
                     }
                     else
                     {
-                         /* Add at header of link list of handlers */
-                         g_handlers = handler;
+                         mime_index_t * e = find_mime_index(type, m->len, m->hash);
+                         if(!e)
+                         {
+                              e = &entries[numEntries++];
+                              e->type = type;
+                              e->hash = m->hash;
+                              e->len = m->len;
+                              e->next = buckets[m->hash & g_cfg->mimeIndexMask];
+                              buckets[m->hash & g_cfg->mimeIndexMask] = e;
+                         }
+                         list = e->handlers;
+                         pNum = &e->numHandlers;
                     }
-                    /* Remember the current end of linked list */
-                    prev_handler = handler;
 
-                    num_handlers++;
-	       }
-
-               type = parseCfgMimeType(lineBuf);
-               if(!type)
-               {
-                    return; /* run out of memory! */
-               }
-               if(prev_type)
-               {
-                    /* Add to end of linked list of handlers */
-                    prev_type->pNext = type;
+                    if(pass == 0)
+                    {
+                         (*pNum)++;
+                    }
+                    else if((*pNum == 0) || (list[*pNum - 1] != i))
+                    {
+                         list[(*pNum)++] = i;
+                    }
                }
-               else
+          }
+
+          if(pass == 0)
+          {
+               int j;
+               g_cfg->wildHandlers = slots;
+               slots += g_cfg->numWildHandlers;
+               for(j = 0; j < numEntries; j++)
                {
-                    /* Add at header of link list of handlers */
-                    handler->types = type;
+                    entries[j].handlers = slots;
+                    slots += entries[j].numHandlers;
+                    entries[j].numHandlers = 0;
                }
-               /* Remember the current end of linked list */
-               prev_type = type;
-	  }
-	  else
-	  {
-               command_t * cmd = parseCfgCmdLine(lineBuf);
-               if(!cmd)
+          }
+     }
+
+     D("Mimetype index built, %d types, %d wildcard handlers\n", numEntries,
+                                                             g_cfg->numWildHandlers);
+}
+
+/**
+ * Find the child of a node of a fmatch automaton for a character.
+ *
+ * @param[in] nodes The nodes of the automaton
+ * @param[in] n The node
+ * @param[in] c The (lower case) character
+ *
+ * @return The child node or zero if none
+ */
+static int fmatch_child(const fmatch_node_t * nodes, int n, unsigned char c)
+{
+     for(n = nodes[n].child; n && (nodes[n].c != c); n = nodes[n].sibling)
+     {
+     }
+     return n;
+}
+
+/**
+ * Build the fmatch automaton for a handler.
+ *
+ * @param[in] h The handler
+ * @param[out] pFm Set to the automaton, or NULL if the handler has no fmatch
+ *                 patterns
+ *
+ * @return false if failed, true otherwise
+ */
+static bool build_fmatch(const handler_t * h, fmatch_t ** pFm)
+{
+     const command_t * const cmds = DB_DEREF(h->cmds);
+     fmatch_t * fm;
+     int * queue;
+     int numPats = 0;
+     int numNodes = 1;
+     int head = 0;
+     int tail = 0;
+     int i;
+
+     *pFm = NULL;
+     for(i = 0; i < h->numCmds; i++)
+     {
+          if(cmds[i].fmatchKind != DB_FMATCH_NONE)
+          {
+               numNodes += cmds[i].fmatchLen;
+               numPats++;
+          }
+     }
+     if(numPats == 0)
+     {
+          return true;
+     }
+
+     fm = allocStaticTable(1, sizeof(fmatch_t));
+     if(!fm ||
+        !(fm->nodes = allocStaticTable(numNodes, sizeof(fmatch_node_t))) ||
+        !(fm->cmds = allocStaticTable(h->numCmds, sizeof(fmatch_cmd_t))) ||
+        !(queue = malloc(numNodes * sizeof(int))))
+     {
+          return false;
+     }
+
+     /* Build the trie, commands with the same pattern are chained together */
+     numNodes = 1;
+     fm->nodes[0].out = -1;
+     for(i = h->numCmds - 1; i >= 0; i--)
+     {
+          const char * pat = DB_STR(cmds[i].fmatchStr);
+          int n = 0;
+
+          fm->cmds[i].next = -1;
+          if(!pat)
+          {
+               continue;
+          }
+          fm->cmds[i].kind = cmds[i].fmatchKind;
+          fm->cmds[i].pat = pat;
+          fm->cmds[i].len = cmds[i].fmatchLen;
+
+          for(; *pat; pat++)
+          {
+               const unsigned char c = tolower((unsigned char) *pat);
+               int child = fmatch_child(fm->nodes, n, c);
+               if(!child)
                {
-                    return; /* run out of memory! */
+                    child = numNodes++;
+                    fm->nodes[child].c = c;
+                    fm->nodes[child].out = -1;
+                    fm->nodes[child].sibling = fm->nodes[n].child;
+                    fm->nodes[n].child = child;
                }
-               if(!handler)
+               n = child;
+          }
+          fm->cmds[i].next = fm->nodes[n].out;
+          fm->nodes[n].out = i;
+     }
+
+     /* Breadth first walk to add the failure and dictionary links */
+     queue[tail++] = 0;
+     while(head < tail)
+     {
+          const int n = queue[head++];
+          int child;
+
+          for(child = fm->nodes[n].child; child; child = fm->nodes[child].sibling)
+          {
+               fmatch_node_t * const node = &fm->nodes[child];
+               int f = 0;
+
+               queue[tail++] = child;
+               if(n != 0)
                {
-                    D("Command before mimetype!\n");
-                    return;
+                    for(f = fm->nodes[n].fail;
+                        f && !fmatch_child(fm->nodes, f, node->c);
+                        f = fm->nodes[f].fail)
+                    {
+                    }
+                    f = fmatch_child(fm->nodes, f, node->c);
                }
+               node->fail = f;
+               node->dict = (fm->nodes[f].out >= 0) ? f : fm->nodes[f].dict;
+          }
+     }
+     free(queue);
+
+     D("fmatch automaton built, %d nodes\n", numNodes);
+     *pFm = fm;
+     return true;
+}
+
+/**
+ * Parse the commands of a handler from N.cmds, see read_config().
+ *
+ * @param[in] idx Index of the handler in g_cfg->handlers
+ */
+static void load_handler_cmds(int idx)
+{
+     /* When read from N.cmds the handlers are in the static arena and
+      * so can be written to */
+     handler_t * const h = (handler_t *) &g_cfg->handlers[idx];
+     command_t * cmds = NULL;
+     char lineBuf[512];
+     int n = 0;
 
-               if(prev_cmd)
+     if((h->numCmds > 0) &&
+        ((cmds = allocStaticTable(h->numCmds, sizeof(command_t))) != NULL) &&
+        (fseek(g_cfg->cmdsFile, g_cfg->cmdsOffsets[idx], SEEK_SET) == 0))
+     {
+          while((n < h->numCmds) && fgets(lineBuf, sizeof(lineBuf), g_cfg->cmdsFile))
+          {
+               if(!chkCfgLine(lineBuf))
                {
-                    /* Add to end of linked list of handlers */
-                    prev_cmd->pNext = cmd;
+                    continue;
                }
-               else
+               if(isCfgMimeType(lineBuf) || !parseCfgCmdLine(lineBuf, &cmds[n]))
                {
-                    /* Add at header of link list of handlers */
-                    handler->cmds = cmd;
+                    break; /* Run out of memory! */
                }
-               /* Remember the current end of linked list */
-               prev_cmd = cmd;
+               n++;
           }
      }
-     D("Num handlers: %d\n", num_handlers);
+
+     D("Loaded %d of %d commands of handler %d\n", n, h->numCmds, idx);
+     DB_SETREF(h->cmds, cmds);
+     h->numCmds = n;
+}
+
+/**
+ * Set up a handler when it is first selected by find_command(), i.e. parse
+ * its commands if not already done and build its fmatch automaton.
+ *
+ * @param[in] idx Index of the handler in g_cfg->handlers
+ */
+static void prepare_handler(int idx)
+{
+     if(g_cfg->handlerReady[idx])
+     {
+          return;
+     }
+     g_cfg->handlerReady[idx] = 1;
+
+     if(g_cfg->cmdsFile)
+     {
+          load_handler_cmds(idx);
+     }
+     if(!build_fmatch(&g_cfg->handlers[idx], &g_cfg->fmatch[idx]))
+     {
+          g_cfg->fmatch[idx] = NULL; /* Fall back to match_url() */
+     }
+}
+
+/**
+ * Empty the command cache, must be called when the config changes.
+ */
+static void clear_cmd_cache(void)
+{
+     memset(g_cfg->cmdCache, 0, sizeof(g_cfg->cmdCache));
+     g_cfg->cmdCacheClock = 0;
 }
 
 /**
@@ -904,23 +2053,43 @@ static bool do_read_config(const char * magic)
 {
      bool retVal = true;
      char * config_fname;
-     if (g_handlers)
+     if (g_cfg->handlers)
      {
           return retVal;
      }
 
      D("do_read_config(%s)\n", magic);
 
-     config_fname = get_cmds_cfg_path(magic);
+     clear_cmd_cache();
+
      get_helper_paths(magic);
 
+     if(map_cmds_db(magic))
+     {
+          build_mime_index();
+          return retVal;
+     }
+
+     config_fname = get_cmds_cfg_path(magic);
      if(config_fname)
      {
           FILE * fd = fopen(config_fname, "rb");
           if(fd)
           {
                read_config(fd);
-               fclose(fd);
+               if(g_cfg->handlers)
+               {
+                    /* Keep the file open for load_handler_cmds(), the file
+                     * is replaced by mozplugger-update renaming over it so
+                     * what is read stays consistent */
+                    fcntl(fileno(fd), F_SETFD, FD_CLOEXEC);
+                    g_cfg->cmdsFile = fd;
+                    build_mime_index();
+               }
+               else
+               {
+                    fclose(fd);
+               }
                D("do_read_config done\n");
           }
           else
@@ -1085,27 +2254,27 @@ static char * parseURL(data_t * const THIS, int extract_filename)
 /**
  * See if the URL matches out match criteria.
  *
+ * @param[in] kind The kind of match DB_FMATCH_xxx
  * @param[in] matchStr The string to match
+ * @param[in] matchStrLen The length of matchStr
  * @param[in] url The url
  *
  * @return 1(true) if matched, zero otherwise
  */
 __inline
-static int match_url(const char * matchStr, const char * url)
+static int match_url(int kind, const char * matchStr, int matchStrLen,
+                                                             const char * url)
 {
-     int matchStrLen;
      const char * end;
 
-     switch (matchStr[0])
+     switch (kind)
      {
-     case '*':
+     case DB_FMATCH_PREFIX:
           /* Does the URL start with the match String */
-          matchStr++; /* Step over the asterisk */
-	  return (strncasecmp(matchStr, url, strlen(matchStr)) == 0);
+	  return (strncasecmp(matchStr, url, matchStrLen) == 0);
 
-     case '%':
+     case DB_FMATCH_SUFFIX:
           /* Does the URL end with the match String */
-          matchStr++; /* Step over the percent sign */
 
           /* Need to find the end of the url, before any
            * extra params i.e'?=xxx' or '#yyy' */
@@ -1116,7 +2285,6 @@ static int match_url(const char * matchStr, const char * url)
                     end = &url[strlen(url)];
                }
           }
-          matchStrLen = strlen(matchStr);
           if(end - matchStrLen < url)
           {
                return 0;
@@ -1130,79 +2298,153 @@ static int match_url(const char * matchStr, const char * url)
 }
 
 /**
- * Go through the commands in the config file and find one that fits our needs.
+ * Run the fmatch automaton of a handler over the URL in one pass. The
+ * commands whose pattern matches are marked with the current generation.
  *
+ * @param[in] fm The automaton
  * @param[in] THIS Pointer to the data associated with this instance of the
  *                       plugin
- * @param[in] streamOnly If true select entry sith stream set only
- * @param[in] c Pointer to command structure to match against
- *
- * @return 1(true) if match, else zero otherwise
  */
-__inline
-static int match_command(const data_t * THIS, int streamOnly, const command_t *c)
+static void run_fmatch(fmatch_t * fm, const data_t * THIS)
 {
-#define MODE_MASK (H_NOEMBED | H_EMBED)
+     const fmatch_node_t * const nodes = fm->nodes;
+     const char * const lower = THIS->urlLower;
+     int n = 0;
+     int pos;
+     int i;
 
-     D("Checking command: %s\n", c->cmd);
+     g_fmatchGen++;
+     if(!lower)
+     {
+          return;
+     }
 
-     /* If command is specific to a particular mode... */
-     if (c->flags & MODE_MASK)
+     /* Empty patterns match everything */
+     for(i = nodes[0].out; i >= 0; i = fm->cmds[i].next)
      {
-          /* Check it matches the current mode... */
-          if ( (THIS->mode_flags & MODE_MASK) != (c->flags & MODE_MASK) )
-          {
-	       D("Flag mismatch: mode different %x != %x\n",
-                     THIS->mode_flags & MODE_MASK,  c->flags & MODE_MASK);
-	       return 0;
-          }
+          fm->cmds[i].seen = g_fmatchGen;
      }
-     if((THIS->mode_flags & H_LINKS) != 0)   /* Requires the links helper? */
+
+     /* pos is the offset just after the current character */
+     for(pos = 1; lower[pos - 1]; pos++)
      {
-          if((c->flags & MODE_MASK) == 0)    /* But command is not */
+          const unsigned char c = lower[pos - 1];
+          int o;
+
+          while(!fmatch_child(nodes, n, c) && n)
+          {
+               n = nodes[n].fail;
+          }
+          n = fmatch_child(nodes, n, c);
+
+          for(o = (nodes[n].out >= 0) ? n : nodes[n].dict; o; o = nodes[o].dict)
           {
-	       D("Flag mismatch: cmd doesnt do links\n");
-	       return 0;
+               for(i = nodes[o].out; i >= 0; i = fm->cmds[i].next)
+               {
+                    fmatch_cmd_t * const fc = &fm->cmds[i];
+                    int hit;
+
+                    switch(fc->kind)
+                    {
+                    case DB_FMATCH_PREFIX:
+                         hit = (pos == fc->len);
+                         break;
+                    case DB_FMATCH_SUFFIX:
+                         hit = (pos == THIS->urlPathLen);
+                         break;
+                    default:
+                         /* Substring match is case sensitive */
+                         hit = (memcmp(&THIS->url[pos - fc->len], fc->pat,
+                                                               fc->len) == 0);
+                         break;
+                    }
+                    if(hit)
+                    {
+                         fc->seen = g_fmatchGen;
+                    }
+               }
           }
      }
+}
+
+/**
+ * Go through the commands in the config file and find one that fits our needs,
+ * the fmatch pattern (if any) is checked by match_handler_cmds(). Which
+ * contexts the command can be used in was worked out by mozplugger-update.
+ *
+ * @param[in] ctx The lookup context, see get_lookup_ctx()
+ * @param[in] c Pointer to command structure to match against
+ *
+ * @return 1(true) if match, else zero otherwise
+ */
+__inline
+static int match_command(unsigned ctx, const command_t *c)
+{
+     D("Checking command: %s\n", DB_STR(c->cmd));
 
-     if ((c->flags & H_LOOP) && (THIS->repeats != INF_LOOPS))
+     if ((c->accept & DB_CTX_BIT(ctx)) == 0)
      {
-	  D("Flag mismatch: loop\n");
+	  D("Flag mismatch: flags %x not for context %x\n", c->flags, ctx);
 	  return 0;
      }
-     if (streamOnly && !(c->flags & H_STREAM))
+
+     D("Flags match\n");
+     return 1;
+}
+
+/**
+ * Work out the context that the commands are being looked up in.
+ *
+ * @param[in] THIS Pointer to the data associated with this instance of the
+ *                       plugin
+ * @param[in] streamOnly If true select entry with stream set only
+ *
+ * @return The context DB_CTX_xxx
+ */
+static unsigned get_lookup_ctx(const data_t * THIS, int streamOnly)
+{
+     unsigned ctx = 0;
+
+     if(THIS->mode_flags & H_EMBED)
      {
-	  D("Flag mismatch: stream only required\n");
-	  return 0;
+          ctx |= DB_CTX_EMBED;
      }
-
-     if(c->fmatchStr)
+     if(THIS->mode_flags & H_NOEMBED)
      {
-          if(!match_url(c->fmatchStr, THIS->url))
-          {
-               D("fmatch mismatch: url '%s' doesnt have '%s'\n",
-                                              THIS->url, c->fmatchStr);
-               return 0;
-          }
+          ctx |= DB_CTX_NOEMBED;
      }
-     D("Match found!\n");
-     return 1;
+     if(THIS->mode_flags & H_LINKS)
+     {
+          ctx |= DB_CTX_LINKS;
+     }
+     if(THIS->repeats == INF_LOOPS)
+     {
+          ctx |= DB_CTX_LOOP;
+     }
+     if(streamOnly)
+     {
+          ctx |= DB_CTX_STREAM;
+     }
+     return ctx;
 }
 
 /**
  * See if mimetype matches.
  *
  * @param[in] reqMimeType pointer to required mimetype
+ * @param[in] reqLen Length of reqMimeType
  * @param[in] m Mimetype to match against
  *
  * @return 1(true) if match, else zero otherwise
  */
 __inline
-static int match_mime_type(const char * reqMimeType, mimetype_t * m)
+static int match_mime_type(const char * reqMimeType, int reqLen,
+                                                         const mimetype_t * m)
 {
+     const char * type = DB_STR(m->type);
      int retVal;
-     if ((strcasecmp(m->type, reqMimeType) != 0) && (strcmp(m->type, "*") != 0))
+     if (!(m->flags & DB_MIMETYPE_ANY) &&
+                   ((m->len != reqLen) || (strcasecmp(type, reqMimeType) != 0)))
      {
           retVal = 0;
      }
@@ -1210,72 +2452,330 @@ static int match_mime_type(const char * reqMimeType, mimetype_t * m)
      {
           retVal = 1;
      }
-     D("Checking '%s' ?= '%s', %s\n", m->type, reqMimeType,
+     D("Checking '%s' ?= '%s', %s\n", type, reqMimeType,
                                             retVal == 1 ? "same" : "different");
      return retVal;
 }
 
 /**
- * See if handler matches, if so check a command is available and return that
- * command.
+ * Record that the result of find_command() depends on the URL matching a
+ * fmatch pattern. Only results that depend on a URL suffix can be cached.
+ *
+ * @param[in,out] pUrlDep Length of URL suffix result depends on, -1 if the
+ *                        result cannot be cached
+ * @param[in] kind The kind of fmatch pattern DB_FMATCH_xxx
+ * @param[in] len The length of the fmatch pattern
+ */
+static void note_url_dep(int * pUrlDep, int kind, int len)
+{
+     if((kind != DB_FMATCH_SUFFIX) || (len > CMD_CACHE_MAX_SUFFIX) || (*pUrlDep < 0))
+     {
+          *pUrlDep = -1;
+     }
+     else if(len > *pUrlDep)
+     {
+          *pUrlDep = len;
+     }
+}
+
+/**
+ * Return the first command of a handler that matches.
  *
- * @param[in] h Pointer to handler to match against
+ * @param[in] idx Index of the handler in g_cfg->handlers
  * @param[in] THIS Pointer to data associated with this instance of plugin
- * @param[in] streamOnly If True select only entry with stream flag
+ * @param[in] ctx The lookup context
+ * @param[in,out] pUrlDep Updated with how the result depends on the URL
  *
  * @return Pointer to command struct if match or NULL
  */
 __inline
-static command_t * match_handler(const handler_t * h, const data_t * THIS, int streamOnly)
+static const command_t * match_handler_cmds(int idx, const data_t * THIS,
+                                             unsigned ctx, int * pUrlDep)
 {
-     mimetype_t *m;
+     const handler_t * const h = &g_cfg->handlers[idx];
+     const command_t * cmds;
+     fmatch_t * fm;
+     int ranFmatch = 0;
+     int i;
+
+     prepare_handler(idx);
+     cmds = DB_DEREF(h->cmds);
+     fm = g_cfg->fmatch[idx];
 
      D("-------------------------------------------\n");
-     D("Commands for this handle at (%p):\n", h->cmds);
+     D("Commands for this handle at (%p):\n", cmds);
+
+     for(i = 0; i < h->numCmds; i++)
+     {
+          const command_t * const c = &cmds[i];
+          const char * const pat = DB_STR(c->fmatchStr);
+          int urlMatch;
+
+          if (!match_command(ctx, c))
+          {
+               continue;
+          }
+          if(!pat)
+          {
+               D("Match found!\n");
+               return c;
+          }
+
+          if(THIS->url)
+          {
+               note_url_dep(pUrlDep, c->fmatchKind, c->fmatchLen);
+          }
+          else
+          {
+               *pUrlDep = -1;
+          }
+
+          if(fm)
+          {
+               if(!ranFmatch)
+               {
+                    run_fmatch(fm, THIS);
+                    ranFmatch = 1;
+               }
+               urlMatch = (fm->cmds[i].seen == g_fmatchGen);
+          }
+          else
+          {
+               urlMatch = THIS->url && match_url(c->fmatchKind, pat,
+                                                    c->fmatchLen, THIS->url);
+          }
+
+          if(urlMatch)
+          {
+               D("Match found!\n");
+               return c;
+          }
+          D("fmatch mismatch: url '%s' doesnt have '%s'\n", THIS->url, pat);
+     }
+     return NULL;
+}
 
-     for(m = h->types; m; m = m->pNext)
+/**
+ * See if handler matches, if so check a command is available and return that
+ * command.
+ *
+ * @param[in] idx Index of the handler in g_cfg->handlers
+ * @param[in] THIS Pointer to data associated with this instance of plugin
+ * @param[in] reqLen Length of the mimetype
+ * @param[in] ctx The lookup context
+ *
+ * @return Pointer to command struct if match or NULL
+ */
+__inline
+static const command_t * match_handler(int idx, const data_t * THIS,
+                                                   int reqLen, unsigned ctx)
+{
+     const handler_t * const h = &g_cfg->handlers[idx];
+     const mimetype_t * m = DB_DEREF(h->types);
+     const mimetype_t * const mEnd = &m[h->numTypes];
+     int urlDep = 0;
+
+     for(; m < mEnd; m++)
      {
-	  if (match_mime_type(THIS->mimetype, m))
+	  if (match_mime_type(THIS->mimetype, reqLen, m))
 	  {
-               command_t * c;
-               for(c = h->cmds; c; c = c->pNext)
-	       {
-		    if (match_command(THIS, streamOnly, c))
-		    {
-			 return c;
-		    }
-	       }
+               return match_handler_cmds(idx, THIS, ctx, &urlDep);
 	  }
      }
      return NULL;
 }
 
 /**
- * Find the appropriate command
+ * Get the tail of the URL path that a cached result may depend on.
+ *
+ * @param[in] THIS Pointer to plugin instance data
+ * @param[in] suffixLen The length of the longest suffix pattern
+ * @param[out] pShort Set if the URL path is shorter than suffixLen
+ * @param[out] pTailLen Set to the length of the tail
+ *
+ * @return Pointer to the (lower case) tail
+ */
+static const char * get_url_tail(const data_t * THIS, int suffixLen,
+                                                  char * pShort, int * pTailLen)
+{
+     *pShort = (THIS->urlPathLen < suffixLen);
+     *pTailLen = *pShort ? THIS->urlPathLen : suffixLen;
+     return &THIS->urlLower[THIS->urlPathLen - *pTailLen];
+}
+
+/**
+ * Look up the command cache.
+ *
+ * @param[in] type The mimetype's index entry (NULL if not in the index)
+ * @param[in] THIS Pointer to plugin instance data
+ * @param[in] ctx The lookup context
+ *
+ * @return Pointer to the cache entry or NULL if none
+ */
+static cmd_cache_t * find_cmd_cache(const mime_index_t * type,
+                                        const data_t * THIS, unsigned ctx)
+{
+     int i;
+
+     for(i = 0; i < CMD_CACHE_SIZE; i++)
+     {
+          cmd_cache_t * const entry = &g_cfg->cmdCache[i];
+
+          if(!entry->used || (entry->type != type) || (entry->ctx != ctx))
+          {
+               continue;
+          }
+          if(entry->suffixLen > 0)
+          {
+               const char * tail;
+               char shortPath;
+               int tailLen;
+
+               if(!THIS->urlLower)
+               {
+                    continue;
+               }
+               tail = get_url_tail(THIS, entry->suffixLen, &shortPath, &tailLen);
+               if((shortPath != entry->shortPath) || (tailLen != entry->tailLen)
+                                   || (memcmp(tail, entry->tail, tailLen) != 0))
+               {
+                    continue;
+               }
+          }
+          entry->lastUsed = ++g_cfg->cmdCacheClock;
+          return entry;
+     }
+     return NULL;
+}
+
+/**
+ * Add the result of find_command() to the command cache, replacing the
+ * least recently used entry.
+ *
+ * @param[in] type The mimetype's index entry (NULL if not in the index)
+ * @param[in] THIS Pointer to plugin instance data
+ * @param[in] ctx The lookup context
+ * @param[in] urlDep Length of URL suffix result depends on
+ * @param[in] command The result
+ */
+static void add_cmd_cache(const mime_index_t * type, const data_t * THIS,
+                  unsigned ctx, int urlDep, const command_t * command)
+{
+     cmd_cache_t * entry = &g_cfg->cmdCache[0];
+     int i;
+
+     for(i = 1; (i < CMD_CACHE_SIZE) && entry->used; i++)
+     {
+          if(!g_cfg->cmdCache[i].used || (g_cfg->cmdCache[i].lastUsed < entry->lastUsed))
+          {
+               entry = &g_cfg->cmdCache[i];
+          }
+     }
+
+     entry->used = 1;
+     entry->type = type;
+     entry->ctx = ctx;
+     entry->suffixLen = urlDep;
+     entry->tailLen = 0;
+     if(urlDep > 0)
+     {
+          const char * tail = get_url_tail(THIS, urlDep, &entry->shortPath,
+                                                             &entry->tailLen);
+          memcpy(entry->tail, tail, entry->tailLen);
+     }
+     entry->lastUsed = ++g_cfg->cmdCacheClock;
+     entry->command = command;
+}
+
+/**
+ * Find the appropriate command. The handlers listing the mimetype are merged
+ * with the wildcard handlers so that the first match is the same as a
+ * linear scan of the config would give. As pages often have many embeds of
+ * the same type, the result is cached unless it depended on more of the URL
+ * than a suffix.
  *
  * @param[in] THIS Pointer to plugin instance data
  * @param[in] streamOnly If true select only the command with stream flag
  *
  * @return Pointer to command struct if match, else NULL otherwise
  */
-static command_t * find_command(const data_t * THIS, int streamOnly)
+static const command_t * find_command(const data_t * THIS, int streamOnly)
 {
-     handler_t * h;
+     const command_t * command = NULL;
+     const unsigned ctx = get_lookup_ctx(THIS, streamOnly);
+     int len;
+     const uint32_t hash = hash_mime_type(THIS->mimetype, &len);
 
      D("find_command...\n");
 
-     for(h = g_handlers; h; h = h->pNext)
+     /* The instance may be of any of the plugin groups */
+     g_cfg = THIS->cfg;
+
+     if(g_cfg->mimeIndex)
      {
-          command_t * command = match_handler(h, THIS, streamOnly);
-          if(command)
-	  {
-	       D("Command found.\n");
-	       return command;
-	  }
+          const mime_index_t * e = find_mime_index(THIS->mimetype, len, hash);
+          const cmd_cache_t * entry = find_cmd_cache(e, THIS, ctx);
+          const int numTyped = e ? e->numHandlers : 0;
+          int urlDep = 0;
+          int t = 0;
+          int w = 0;
+
+          if(entry)
+          {
+               g_cmdCacheHits++;
+               D("Command cache hit (hits=%u, misses=%u)\n", g_cmdCacheHits,
+                                                            g_cmdCacheMisses);
+               return entry->command;
+          }
+          g_cmdCacheMisses++;
+          D("Command cache miss (hits=%u, misses=%u)\n", g_cmdCacheHits,
+                                                            g_cmdCacheMisses);
+
+          D("Mimetype '%s' has %d handlers, %d wildcard handlers\n",
+                                THIS->mimetype, numTyped, g_cfg->numWildHandlers);
+
+          while(!command && ((t < numTyped) || (w < g_cfg->numWildHandlers)))
+          {
+               int i;
+               if((w >= g_cfg->numWildHandlers) ||
+                             ((t < numTyped) && (e->handlers[t] <= g_cfg->wildHandlers[w])))
+               {
+                    i = e->handlers[t++];
+                    if((w < g_cfg->numWildHandlers) && (g_cfg->wildHandlers[w] == i))
+                    {
+                         w++;
+                    }
+               }
+               else
+               {
+                    i = g_cfg->wildHandlers[w++];
+               }
+               command = match_handler_cmds(i, THIS, ctx, &urlDep);
+          }
+
+          if(urlDep >= 0)
+          {
+               add_cmd_cache(e, THIS, ctx, urlDep, command);
+          }
+     }
+     else
+     {
+          int i;
+          for(i = 0; !command && (i < g_cfg->numHandlers); i++)
+          {
+               command = match_handler(i, THIS, len, ctx);
+          }
      }
 
-     D("No command found.\n");
-     return NULL;
+     if(command)
+     {
+          D("Command found.\n");
+     }
+     else
+     {
+          D("No command found.\n");
+     }
+     return command;
 }
 
 /**
@@ -1288,12 +2788,16 @@ static command_t * find_command(const data_t * THIS, int streamOnly)
 const char * NP2_GetPluginVersion(const char * magic)
 {
      D("NP_GetPluginVersion(%s)\n", magic);
+     if(!select_cfg(magic))
+     {
+          return VERSION;
+     }
      if(!is_base_mozplugger(magic))
      {
           get_helper_paths(magic);
      }
-     D("NP_GetPluginVersion returning '%s'\n", g_version);
-     return g_version;
+     D("NP_GetPluginVersion returning '%s'\n", g_cfg->version);
+     return g_cfg->version;
 }
 
 /**
@@ -1337,21 +2841,114 @@ static bool mozplugger_update(bool * pDoesntExist)
                status = WEXITSTATUS(status);
                if(status != EXIT_SUCCESS)
                {
-                    D("mozplugger-update exited with status: %d\n", status);
-                    success = false;
-                    if(status == 1000)
-                    {
-                         *pDoesntExist = true;
-                    }
+                    D("mozplugger-update exited with status: %d\n", status);
+                    success = false;
+                    if(status == 1000)
+                    {
+                         *pDoesntExist = true;
+                    }
+               }
+         }
+     }
+     D("mozplugger-update done\n");
+     if(success)
+     {
+//         NPN_ReloadPlugins(false);
+     }
+     return success;
+}
+
+/**
+ * Take the lock that stops more than one background refresh running at a
+ * time, every copy of the plugin calls NP_GetMIMEDescription() during the
+ * same browser plugin scan. A lock left by a refresh that died is ignored
+ * once it is UPDATE_LOCK_STALE seconds old.
+ *
+ * @param[out] lockName Set to the path of the lock file
+ * @param[in] lockNameLen Size of lockName
+ *
+ * @return true if lock taken
+ */
+static bool take_update_lock(char * lockName, int lockNameLen)
+{
+     struct stat details;
+     int fd;
+
+     get_cfg_path_prefix(".update_lock:", lockName, lockNameLen);
+
+     fd = open(lockName, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+     if((fd < 0) && (errno == EEXIST) && (stat(lockName, &details) == 0) &&
+                        (time(NULL) - details.st_mtime > UPDATE_LOCK_STALE))
+     {
+          D("Removing stale update lock\n");
+          unlink(lockName);
+          fd = open(lockName, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+     }
+     if(fd < 0)
+     {
+          D("Update already in progress\n");
+          return false;
+     }
+     close(fd);
+     return true;
+}
+
+/**
+ * Rebuild the cached versions of configuration without waiting for it to
+ * finish. The child forks again and exits at once so that the process that
+ * waits for mozplugger-update (and then removes the lock) is not a child of
+ * the browser and never has to be reaped by it. The browser picks up the
+ * result the next time it rescans the plugins.
+ */
+static void mozplugger_update_detached(void)
+{
+     char lockName[256];
+     pid_t pid;
+
+     if(!take_update_lock(lockName, sizeof(lockName)))
+     {
+          return;
+     }
+
+     D("Starting background mozplugger-update\n");
+     pid = fork();
+     if(pid == -1)
+     {
+          D("Failed to fork\n");
+          unlink(lockName);
+     }
+     else if(pid == 0)
+     {
+          setsid();
+          pid = fork();
+          if(pid == 0)
+          {
+               int status;
+
+               pid = fork();
+               if(pid == 0)
+               {
+	            execlp("mozplugger-update", "mozplugger-update", NULL);
+                    _exit(EXIT_FAILURE);
                }
-         }
+               else if(pid > 0)
+               {
+                    waitpid(pid, &status, 0);
+               }
+               unlink(lockName);
+               _exit(EXIT_SUCCESS);
+          }
+          else if(pid == -1)
+          {
+               unlink(lockName);
+          }
+          _exit(EXIT_SUCCESS);
      }
-     D("mozplugger-update done\n");
-     if(success)
+     else
      {
-//         NPN_ReloadPlugins(false);
+          int status;
+          waitpid(pid, &status, 0);
      }
-     return success;
 }
 
 /**
@@ -1489,7 +3086,21 @@ static bool chk_cached_is_newer(char * buf, time_t cached_ftime)
     return false;
 }
 
-static char * read_desc(const char * fname, time_t ts_ftime, bool *update, bool is_base)
+/**
+ * Read the mimetype description from the cache. A cache that was written
+ * from an older mozpluggerrc is still returned (so it can be served until
+ * a refresh is done) but update is set.
+ *
+ * @param[in] fname The name of the N.mimetypes file
+ * @param[in] ts_ftime The time of the last update
+ * @param[out] update Set if the cache needs to be updated
+ * @param[out] have_cache Set if the cache exists and is usable
+ * @param[in] is_base True if the base plugin (which has no mimetypes)
+ *
+ * @return The description or NULL
+ */
+static char * read_desc(const char * fname, time_t ts_ftime, bool *update,
+                                                bool *have_cache, bool is_base)
 {
      char * desc = NULL;
      FILE * fp = fopen(fname, "rb");
@@ -1501,9 +3112,15 @@ static char * read_desc(const char * fname, time_t ts_ftime, bool *update, bool
           
           if( fgets(linebuf, sizeof(linebuf), fp)
                   && chk_version_matches(linebuf) 
-                      && fgets(linebuf, sizeof(linebuf), fp)
-                          && chk_cached_is_newer(linebuf, ts_ftime))
+                      && fgets(linebuf, sizeof(linebuf), fp))
           {
+                if(!chk_cached_is_newer(linebuf, ts_ftime))
+                {
+                     D("Cached description is stale\n");
+                     *update = true;
+                }
+                *have_cache = true;
+
                 while( fgets(linebuf, sizeof(linebuf), fp) && (linebuf[0] == '#'))
                      ;
                
@@ -1539,24 +3156,57 @@ static char * read_desc(const char * fname, time_t ts_ftime, bool *update, bool
 }
 
 /**
- * Construct a MIME Description string for netscape so that mozilla shall know
- * when to call us back.
+ * Get the MIME Description from the manifest, if the manifest is out of
+ * date it is served anyway and a refresh started in the background.
  *
  * @param[in] magic references for this particular plugin type
+ * @param[in] plugin The plugin's entry in the manifest
  *
- * @return Pointer to string containing mime decription for this plugin
+ * @return The description or NULL
  */
-const char * NP2_GetMIMEDescription(const char * magic)
+static char * get_manifest_desc(const char * magic,
+                                            const manifest_plugin_t * plugin)
+{
+     const char * const mimetypes = DB_STR(plugin->mimetypes);
+     char * desc = NULL;
+
+     if(g_manifestStale)
+     {
+          bool update = true;
+          bool dont_update = false;
+
+          chkTimeToUpdate(&update, &dont_update);
+          if(!dont_update)
+          {
+               mozplugger_update_detached();
+          }
+     }
+
+     if(!is_base_mozplugger(magic) && mimetypes)
+     {
+          desc = strdup(mimetypes);
+     }
+     return desc;
+}
+
+/**
+ * Get the MIME Description from the cached N.mimetypes file, used if
+ * there is no usable manifest.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return The description or NULL
+ */
+static char * get_cached_desc(const char * magic)
 {
      char * fname;
      char * desc;
      bool update = false;
      bool dont_update = false;
      bool doesnt_exist = false;
+     bool have_cache = false;
      time_t ts_ftime;
 
-     D("NP_GetMIMEDescription(%s)\n", magic);
-
      if(!chkValidLocalPluginDirs())
      {
           D("Local plugin dirs not valid");
@@ -1566,33 +3216,66 @@ const char * NP2_GetMIMEDescription(const char * magic)
      /* Check the last time we updated the cache */
      ts_ftime = chkTimeToUpdate( &update, &dont_update);
 
-     if(update && !dont_update)
-     {
-          mozplugger_update(&doesnt_exist);
-          ts_ftime = time(NULL);
-          dont_update = true;
-          update = false;
-     }     
-
      fname = get_mimetypes_cfg_path(magic);
-     desc = read_desc(fname, ts_ftime, &update, is_base_mozplugger(magic));
+     desc = read_desc(fname, ts_ftime, &update, &have_cache,
+                                                     is_base_mozplugger(magic));
 
      if(update && !dont_update)
      {
-          mozplugger_update(&doesnt_exist);
-          ts_ftime = time(NULL);
-          update = false;
-
-          free(desc);
-          desc = read_desc(fname, ts_ftime, &update, is_base_mozplugger(magic));
+          if(have_cache)
+          {
+               /* Serve what is cached now rather than hold up the browser,
+                * the refreshed description is used on the next rescan */
+               mozplugger_update_detached();
+          }
+          else
+          {
+               mozplugger_update(&doesnt_exist);
+               ts_ftime = time(NULL);
 
+               free(desc);
+               desc = read_desc(fname, ts_ftime, &update, &have_cache,
+                                                     is_base_mozplugger(magic));
+          }
      }
      free(fname);
 
-     if(!desc && update && !doesnt_exist && !haveError())
+     if(!have_cache && update && !doesnt_exist && !haveError())
      {
           reportError(NULL, "Please close browser and run mozplugger-update");
      }
+     return desc;
+}
+
+/**
+ * Construct a MIME Description string for netscape so that mozilla shall know
+ * when to call us back.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return Pointer to string containing mime decription for this plugin
+ */
+const char * NP2_GetMIMEDescription(const char * magic)
+{
+     const manifest_plugin_t * plugin;
+     char * desc = NULL;
+
+     D("NP_GetMIMEDescription(%s)\n", magic);
+
+     chk_manifest_replaced();
+
+     if(!select_cfg(magic))
+     {
+          /* Reported below */
+     }
+     else if((plugin = get_manifest_plugin(magic)) != NULL)
+     {
+          desc = get_manifest_desc(magic, plugin);
+     }
+     else
+     {
+          desc = get_cached_desc(magic);
+     }
 
      if(haveError())
      {
@@ -1638,7 +3321,7 @@ static const char * getPluginName(const char * magic)
      {
           get_helper_paths(magic);
      }
-     return g_pluginName;
+     return g_cfg->pluginName;
 }
 
 /**
@@ -1653,9 +3336,22 @@ static const char * getPluginDescription(const char * magic)
      static char desc_buffer[8192];
      const char * dbgPath = get_debug_path();
      char * config_fname = get_cmds_cfg_path(magic);
+     time_t cached = 0;
      struct stat details;
 
-     if(is_base_mozplugger(magic) || (!config_fname) || (stat(config_fname, &details) != 0))
+     if(!is_base_mozplugger(magic) && config_fname)
+     {
+          if(get_manifest_plugin(magic))
+          {
+               cached = g_manifest->updated;
+          }
+          else if(stat(config_fname, &details) == 0)
+          {
+               cached = details.st_mtime;
+          }
+     }
+
+     if(cached == 0)
      {
           snprintf(desc_buffer, sizeof(desc_buffer),
 		   "MozPlugger version " VERSION
@@ -1667,12 +3363,8 @@ static const char * getPluginDescription(const char * magic)
      {
           const char * home = get_home_dir();
           char * pCfg = NULL;
-          struct stat details;
           int i;
 
-          details.st_mtime = 0;
-          stat(config_fname, &details);
-
           /* removed cmds and replace with '*' */
           i = strlen(config_fname)-4;
           config_fname[i++] = '*';
@@ -1702,7 +3394,7 @@ static const char * getPluginDescription(const char * magic)
                    "%s%s%s"
 		   " </table>"
 		   "<br clear=all>",
-                   pCfg, asctime(localtime(&details.st_mtime)),
+                   pCfg, asctime(localtime(&cached)),
                    dbgPath ? "<tr><td>Debug file:</td><td>" : "",
                    dbgPath ? dbgPath : "",
                    dbgPath ? "/" DEBUG_FILENAME "</td><td></td></tr>" : ""
@@ -1763,6 +3455,11 @@ NPError NP2_GetValue(const char * magic, NPPVariable variable, void *value)
 
      D("NP_GetValue(%.20s, %s)\n", magic, NPPVariableToString(variable));
 
+     if(!select_cfg(magic))
+     {
+          return NPERR_OUT_OF_MEMORY_ERROR;
+     }
+
      switch (variable)
      {
      case NPPVpluginNameString:
@@ -1874,6 +3571,33 @@ static int my_atoi(const char *s, int my_true, int my_false)
      return -1;
 }
 
+/**
+ * Look up a tag attribute name in the perfect hash table generated from
+ * npp_attrs.h, costs one hash and at most one compare.
+ *
+ * @param[in] name The attribute name (any case)
+ *
+ * @return The NPP_ATTR_xxx or NPP_ATTR_NONE if not one we act on
+ */
+static int find_npp_attr(const char * name)
+{
+     const npp_attr_slot_t * slot;
+     uint32_t hash = NPP_ATTR_SEED;
+     const char * p;
+
+     for(p = name; *p; p++)
+     {
+          hash = NPP_ATTR_HASH_STEP(hash, *p);
+     }
+
+     slot = &g_nppAttrSlots[NPP_ATTR_SLOT(hash, NPP_ATTR_MASK)];
+     if(slot->name && (strcasecmp(slot->name, name) == 0))
+     {
+          return slot->id;
+     }
+     return NPP_ATTR_NONE;
+}
+
 /**
  * Initialize another instance of mozplugger. It is important to know
  * that there might be several instances going at one time.
@@ -1931,7 +3655,9 @@ NPError NPP_New(NPMIMEType pluginType, NPP instance, uint16_t mode,
      THIS->repeats = 1;
      THIS->autostart = 1;
      THIS->autostartNotSeen = 1;
+     THIS->cfg = g_cfg;
      THIS->tmpFileFd = -1;
+     THIS->stdinFd = -1;
 
      if(mode == NP_EMBED)
      {
@@ -1961,60 +3687,65 @@ NPError NPP_New(NPMIMEType pluginType, NPP instance, uint16_t mode,
 
      for (e = 0; e < argc; e++)
      {
-	  if (strcasecmp("loop", argn[e]) == 0)
+	  switch(find_npp_attr(argn[e]))
 	  {
+	  case NPP_ATTR_LOOP:
 	       THIS->repeats = my_atoi(argv[e], INF_LOOPS, 1);
-	  }
+	       break;
+
           /* realplayer also uses numloop tag */
           /* windows media player uses playcount */
-          else if((strcasecmp("numloop", argn[e]) == 0) ||
-                  (strcasecmp("playcount", argn[e]) == 0))
-          {
+          case NPP_ATTR_NUMLOOP:
+          case NPP_ATTR_PLAYCOUNT:
 	       THIS->repeats = atoi(argv[e]);
-          }
-	  else if((strcasecmp("autostart", argn[e]) == 0) ||
-	          (strcasecmp("autoplay", argn[e]) == 0))
-	  {
+               break;
+
+	  case NPP_ATTR_AUTOSTART:
+	  case NPP_ATTR_AUTOPLAY:
                autostart_idx = e;
-	  }
+               break;
+
 	  /* get the index of the src attribute if this is a 'embed' tag */
-	  else if (strcasecmp("src", argn[e]) == 0)
-	  {
+	  case NPP_ATTR_SRC:
 	       src_idx = e;
-	  }
+	       break;
+
 	  /* get the index of the data attribute if this is a 'object' tag */
-          else if (strcasecmp("data", argn[e]) == 0)
-          {
+          case NPP_ATTR_DATA:
                data_idx = e;
-          }
+               break;
+
           /* Special case for quicktime. If there's an href or qtsrc attribute,
            * remember it for now */
-          else if((strcasecmp("href", argn[e]) == 0) ||
-	            (strcasecmp("qtsrc", argn[e]) == 0))
-          {
+          case NPP_ATTR_HREF:
+          case NPP_ATTR_QTSRC:
                if(href_idx == -1)
                {
                     href_idx = e;
                }
-          }
-          else if((strcasecmp("filename", argn[e]) == 0) ||
-	            (strcasecmp("url", argn[e]) == 0) ||
-	            (strcasecmp("location", argn[e]) == 0))
-          {
+               break;
+
+          case NPP_ATTR_FILENAME:
+          case NPP_ATTR_URL:
+          case NPP_ATTR_LOCATION:
                if(alt_idx == -1)
                {
                     alt_idx = e;
                }
-          }
+               break;
+
           /* Special case for quicktime. If there's an autohref or target
            * attributes remember them for now */
-          else if (strcasecmp("target", argn[e]) == 0)
-          {
+          case NPP_ATTR_TARGET:
                target_idx = e;
-          }
-	  else if(strcasecmp("autohref", argn[e]) == 0)
-	  {
+               break;
+
+	  case NPP_ATTR_AUTOHREF:
                autohref_idx = e;
+	       break;
+
+          default:
+               break;
 	  }
 
 	  /* copy the flag to put it into the environment later */
@@ -2073,7 +3804,7 @@ NPError NPP_New(NPMIMEType pluginType, NPP instance, uint16_t mode,
 
      if (url)
      {
-          THIS->url = url;
+          set_url(THIS, url);
 
           /* Mozilla does not support the following protocols directly and
            * so it never calls NPP_NewStream for these protocols */
@@ -2209,6 +3940,14 @@ NPError NPP_Destroy(NPP instance, NPSavedData** save)
           {
                close(THIS->tmpFileFd);
           }
+          if(THIS->stdinFd >= 0)
+          {
+               close(THIS->stdinFd);
+          }
+          if(THIS->spool)
+          {
+               NPN_MemFree(THIS->spool);
+          }
           if(THIS->tmpFileName != 0)
           {
                char * p;
@@ -2246,6 +3985,8 @@ NPError NPP_Destroy(NPP instance, NPSavedData** save)
                NPN_MemFree(THIS->urlFragment);
           }
 
+          set_url(THIS, NULL);
+
 	  NPN_MemFree(instance->pdata);
 	  instance->pdata = NULL;
      }
@@ -2261,10 +4002,12 @@ NPError NPP_Destroy(NPP instance, NPSavedData** save)
  * @param[in] instance Pointer to the plugin instance data
  * @param[in] fname The filename of the embedded object
  * @param[in] isURL Is the filename a URL?
+ * @param[in] childStdin File descriptor to be the child's stdin or -1
  *
  * @return Nothing
  */
-static void new_child(NPP instance, const char* fname, int isURL)
+static void new_child(NPP instance, const char* fname, int isURL,
+                                                                int childStdin)
 {
      int commsPipe[2];
      data_t * THIS;
@@ -2279,6 +4022,7 @@ static void new_child(NPP instance, const char* fname, int isURL)
      }
 
      THIS = instance->pdata;
+     g_cfg = THIS->cfg; /* For the helper paths */
 
      if (THIS->pid != -1)
      {
@@ -2329,6 +4073,11 @@ static void new_child(NPP instance, const char* fname, int isURL)
 
 	  close_debug();
 
+          if(childStdin >= 0)
+          {
+               dup2(childStdin, 0);
+          }
+
   /* Close all those File descriptors inherited from the
    * parent, except the pipes and stdin, stdout, stderr */
 
@@ -2445,6 +4194,25 @@ static int guessTmpFile(const char * fileName, int soFar,
      return fd;
 }
 
+/**
+ * Get the minimum time between progress messages to the helper, from
+ * the maximum number of messages a second in MOZPLUGGER_PROGRESS_RATE
+ * (zero for no limit).
+ *
+ * @return Interval in microseconds
+ */
+static long getProgressInterval(void)
+{
+     const char * rateStr = getenv("MOZPLUGGER_PROGRESS_RATE");
+     int rate = DEFAULT_PROGRESS_RATE;
+
+     if(rateStr)
+     {
+          rate = atoi(rateStr);
+     }
+     return (rate > 0) ? 1000000L / rate : 0;
+}
+
 /**
  * From the url create a temporary file to hold a copy of th URL contents.
  *
@@ -2514,6 +4282,54 @@ static int createTmpFile(char ** pFileName)
      return fd;
 }
 
+/**
+ * For commands with the stdin flag, start the helper with its stdin a pipe
+ * that NPP_Write() passes the data down as it arrives.
+ *
+ * @param[in] instance Pointer to the plugin instance data
+ *
+ * @return Returns error code if a problem
+ */
+static NPError startStdinChild(NPP instance)
+{
+     data_t * const THIS = instance->pdata;
+     int stdinPipe[2];
+
+     THIS->spool = NPN_MemAlloc(SPOOL_SIZE);
+     if(THIS->spool == NULL)
+     {
+          return NPERR_OUT_OF_MEMORY_ERROR;
+     }
+     THIS->spoolLen = 0;
+     THIS->tmpFileSize = 0;
+
+     THIS->progressInterval = getProgressInterval();
+     gettimeofday(&THIS->progressTime, NULL);
+     THIS->progressBytes = 0;
+
+     if(pipe(stdinPipe) < 0)
+     {
+	  reportError(instance, "MozPlugger: Failed to create a pipe!");
+	  return NPERR_GENERIC_ERROR;
+     }
+
+     /* NPP_Write() must never block, NPP_WriteReady() holds the browser
+      * back when the spool is full instead */
+     fcntl(stdinPipe[1], F_SETFL, O_NONBLOCK);
+
+     THIS->repeats = 1; /* The data can only be read once */
+     new_child(instance, "-", 0, stdinPipe[0]);
+     close(stdinPipe[0]);
+
+     if(THIS->pid == -1)
+     {
+          close(stdinPipe[1]);
+	  return NPERR_GENERIC_ERROR;
+     }
+     THIS->stdinFd = stdinPipe[1];
+     return NPERR_NO_ERROR;
+}
+
 /**
  * Open a new stream.
  * Each instance can only handle one stream at a time.
@@ -2562,7 +4378,7 @@ NPError NPP_NewStream(NPP instance, NPMIMEType type, NPStream *stream,
           {
                /* URL has changed */
                D("URL has changed to %s\n", THIS->href);
-               THIS->url = THIS->href;
+               set_url(THIS, THIS->href);
                refind_command = 1;
           }
      }
@@ -2570,7 +4386,7 @@ NPError NPP_NewStream(NPP instance, NPMIMEType type, NPStream *stream,
      {
           /* URL has changed */
           D("URL has changed to %s\n", stream->url);
-          THIS->url = (char *) stream->url;
+          set_url(THIS, (char *) stream->url);
           refind_command = 1;
      }
 
@@ -2606,50 +4422,164 @@ NPError NPP_NewStream(NPP instance, NPMIMEType type, NPStream *stream,
           THIS->command = find_command(THIS, 0);
           D("Mime type %s\n", type);
      }
-
-     if(THIS->command == 0)
+
+     if(THIS->command == 0)
+     {
+	  reportError(instance, "MozPlugger: No appropriate application found.");
+	  return NPERR_GENERIC_ERROR;
+     }
+
+     /* Extract from the URL the various additional information */
+     fileName = parseURL(THIS, 1);
+     D("fileName (pre-header parse) = %s\n", fileName);
+
+     /* Extract the fileName from HTTP headers, overide URL fileName */
+     fileName = parseHeaders(THIS, stream->headers, fileName);
+     D("fileName = %s\n", fileName);
+
+     if(THIS->command->flags & H_STREAM)
+     {
+          NPN_MemFree(fileName);
+          new_child(instance, THIS->url, 1, -1);
+     }
+     else if(THIS->command->flags & H_STDIN)
+     {
+          NPN_MemFree(fileName);
+          return startStdinChild(instance);
+     }
+     else if(THIS->command->flags & H_ASFILE)
+     {
+          /* The browser saves the stream to its own file anyway, so get it
+           * to pass us that file in NPP_StreamAsFile() rather than it also
+           * passing us the data to save again. The temp file just reserves
+           * the name the browser's file is linked to */
+          const int fd = createTmpFile(&fileName);
+
+          if(fd < 0)
+          {
+	       reportError(instance, "MozPlugger: Failed to create tmp file");
+	       return NPERR_GENERIC_ERROR;
+          }
+          close(fd);
+          THIS->tmpFileName = fileName;
+
+          D("Asking for the browser's file\n");
+          *stype = NP_ASFILEONLY;
+          return NPERR_NO_ERROR;
+     }
+     else
+     {
+          THIS->tmpFileFd = createTmpFile(&fileName);
+
+          if(THIS->tmpFileFd < 0)
+          {
+	       reportError(instance, "MozPlugger: Failed to create tmp file");
+	       return NPERR_GENERIC_ERROR;
+          }
+          else
+          {
+               /* Make file read only by us only */
+               fchmod(THIS->tmpFileFd, 0400);
+               THIS->tmpFileName = fileName;
+               THIS->tmpFileSize = 0;
+
+               /* If no spool, the data is written straight to the file */
+               THIS->spool = NPN_MemAlloc(SPOOL_SIZE);
+               THIS->spoolLen = 0;
+               THIS->writeReady = CHUNK_SIZE;
+               gettimeofday(&THIS->rateStart, NULL);
+               THIS->rateBytes = 0;
+
+               THIS->progressInterval = getProgressInterval();
+               THIS->progressTime = THIS->rateStart;
+               THIS->progressBytes = 0;
+
+               THIS->progressiveStart = PROGRESSIVE_START_BYTES;
+               if((stream->end > 0) && (stream->end / 100 * PROGRESSIVE_START_PERCENT
+                                                   < THIS->progressiveStart))
+               {
+                    THIS->progressiveStart =
+                                stream->end / 100 * PROGRESSIVE_START_PERCENT;
+               }
+          }
+     }
+
+     *stype = NP_NORMAL;
+     return NPERR_NO_ERROR;
+}
+
+/**
+ * Give the temp file the contents of the browser's file, by linking the
+ * browser's file to it or if that is not possible copying it. The browser
+ * may delete its file as soon as NPP_StreamAsFile() returns.
+ *
+ * @param[in] browserFile The browser's file
+ * @param[in] tmpFileName The temp file
+ *
+ * @return true if done
+ */
+static bool keepBrowserFile(const char * browserFile, const char * tmpFileName)
+{
+     char buffer[CHUNK_SIZE];
+     int inFd;
+     int outFd;
+     ssize_t n;
+     bool ok = true;
+
+     unlink(tmpFileName);
+     if(link(browserFile, tmpFileName) == 0)
+     {
+          D("Linked '%s' to '%s'\n", browserFile, tmpFileName);
+          return true;
+     }
+
+     D("Failed to link '%s', errno=%i, copying\n", browserFile, errno);
+     if((inFd = open(browserFile, O_RDONLY)) < 0)
+     {
+          return false;
+     }
+     if((outFd = open(tmpFileName, O_CREAT | O_EXCL | O_WRONLY, S_IRUSR | S_IWUSR)) < 0)
      {
-	  reportError(instance, "MozPlugger: No appropriate application found.");
-	  return NPERR_GENERIC_ERROR;
+          close(inFd);
+          return false;
      }
 
-     /* Extract from the URL the various additional information */
-     fileName = parseURL(THIS, 1);
-     D("fileName (pre-header parse) = %s\n", fileName);
-
-     /* Extract the fileName from HTTP headers, overide URL fileName */
-     fileName = parseHeaders(THIS, stream->headers, fileName);
-     D("fileName = %s\n", fileName);
-
-     if( (THIS->command->flags & H_STREAM) == 0)
+     while(ok && ((n = read(inFd, buffer, sizeof(buffer))) != 0))
      {
-          THIS->tmpFileFd = createTmpFile(&fileName);
-
-          if(THIS->tmpFileFd < 0)
+          if(n < 0)
           {
-	       reportError(instance, "MozPlugger: Failed to create tmp file");
-	       return NPERR_GENERIC_ERROR;
+               ok = (errno == EINTR);
           }
           else
           {
-               /* Make file read only by us only */
-               fchmod(THIS->tmpFileFd, 0400);
-               THIS->tmpFileName = fileName;
-               THIS->tmpFileSize = 0;
+               ssize_t done = 0;
+
+               while(ok && (done < n))
+               {
+                    const ssize_t ret = write(outFd, &buffer[done], n - done);
+                    if(ret >= 0)
+                    {
+                         done += ret;
+                    }
+                    else
+                    {
+                         ok = (errno == EINTR);
+                    }
+               }
           }
      }
-     else
-     {
-          NPN_MemFree(fileName);
-          new_child(instance, THIS->url, 1);
-     }
 
-     *stype = NP_NORMAL;
-     return NPERR_NO_ERROR;
+     fchmod(outFd, 0400);
+     close(outFd);
+     close(inFd);
+     return ok;
 }
 
 /**
- * Called after NPP_NewStream if *stype = NP_ASFILEONLY.
+ * Called after NPP_NewStream if *stype = NP_ASFILEONLY, i.e. for commands
+ * with the asfile flag. The helper is run on a link to or copy of the
+ * browser's file in our temp dir, as the browser may delete its file
+ * before the helper has opened it.
  *
  * @param[in] instance Pointer to plugin instance data
  * @param[in] stream Pointer to the stream data structure
@@ -2663,7 +4593,17 @@ void NPP_StreamAsFile(NPP instance, NPStream *stream, const char* fname)
 
      if (instance != NULL)
      {
-          new_child(instance, fname, 0);
+          data_t * const THIS = instance->pdata;
+
+          if(fname && THIS->tmpFileName
+                           && keepBrowserFile(fname, THIS->tmpFileName))
+          {
+               new_child(instance, THIS->tmpFileName, 0, -1);
+          }
+          else
+          {
+               new_child(instance, fname, 0, -1);
+          }
      }
 }
 
@@ -2806,8 +4746,8 @@ NPError NPP_SetWindow(NPP instance, NPWindow* window)
           /* Extract from the URL the various additional information */
           (void) parseURL(THIS, 0);
 
-	  new_child(instance, THIS->url, 1);
-          THIS->url = NULL; /* Stops new_child from being called again */
+	  new_child(instance, THIS->url, 1, -1);
+          set_url(THIS, NULL); /* Stops new_child from being called again */
 	  return NPERR_NO_ERROR;
      }
 
@@ -2850,7 +4790,7 @@ static void sendProgressMsg(data_t * THIS)
           PipeMsg_t msg;
 
           msg.msgType = PROGRESS_MSG;
-          msg.progress_msg.done = (THIS->tmpFileFd < 0);
+          msg.progress_msg.done = (THIS->tmpFileFd < 0) && (THIS->stdinFd < 0);
           msg.progress_msg.bytes = THIS->tmpFileSize;
 
           ret = write(THIS->commsPipeFd, (char *) &msg, sizeof(msg));
@@ -2860,6 +4800,365 @@ static void sendProgressMsg(data_t * THIS)
                close(THIS->commsPipeFd);
                THIS->commsPipeFd = -1;
           }
+          THIS->progressBytes = THIS->tmpFileSize;
+     }
+}
+
+/**
+ * Write all of the data described by the iovec to the temp file, carrying on
+ * after any partial writes
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ * @param[in,out] iov The data to write, modified as it is written
+ * @param[in] iovcnt Number of entries in iov
+ *
+ * @return false on error
+ */
+static bool writeAllToTmpFile(data_t * THIS, struct iovec * iov, int iovcnt)
+{
+     while(iovcnt > 0)
+     {
+          ssize_t ret = writev(THIS->tmpFileFd, iov, iovcnt);
+          if(ret < 0)
+          {
+               if(errno == EINTR)
+               {
+                    continue;
+               }
+               D("Writing to temporary file failed\n");
+               return false;
+          }
+
+          THIS->tmpFileSize += ret;
+          while((iovcnt > 0) && (ret >= iov->iov_len))
+          {
+               ret -= iov->iov_len;
+               iov++;
+               iovcnt--;
+          }
+          if(iovcnt > 0)
+          {
+               iov->iov_base = (char *) iov->iov_base + ret;
+               iov->iov_len -= ret;
+          }
+     }
+     return true;
+}
+
+/**
+ * Add data from the browser to the spool. When the spool cannot take it all
+ * the spool and as much of the new data as ends the temp file on a
+ * CHUNK_SIZE boundary are written in one go, the rest starts the next spool.
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ * @param[in] buf The data
+ * @param[in] len The amount of data
+ *
+ * @return The amount of data taken or -1 on error
+ */
+static int32_t spoolData(data_t * THIS, char * buf, int32_t len)
+{
+     struct iovec iov[2];
+     int32_t n;
+
+     if(THIS->spool == NULL)
+     {
+          iov[0].iov_base = buf;
+          iov[0].iov_len = len;
+          return writeAllToTmpFile(THIS, iov, 1) ? len : -1;
+     }
+
+     if(THIS->spoolLen + len <= SPOOL_SIZE)
+     {
+          memcpy(&THIS->spool[THIS->spoolLen], buf, len);
+          THIS->spoolLen += len;
+          return len;
+     }
+
+     n = THIS->tmpFileSize + THIS->spoolLen + len;
+     n = len - (n % CHUNK_SIZE);
+     if(n < 0)
+     {
+          n = 0;
+     }
+
+     iov[0].iov_base = THIS->spool;
+     iov[0].iov_len = THIS->spoolLen;
+     iov[1].iov_base = buf;
+     iov[1].iov_len = n;
+     if(!writeAllToTmpFile(THIS, iov, 2))
+     {
+          return -1;
+     }
+
+     memcpy(THIS->spool, &buf[n], len - n);
+     THIS->spoolLen = len - n;
+     return len;
+}
+
+/**
+ * Write whatever is in the spool to the temp file
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ */
+static void writeSpool(data_t * THIS)
+{
+     if(THIS->spoolLen > 0)
+     {
+          struct iovec iov;
+
+          iov.iov_base = THIS->spool;
+          iov.iov_len = THIS->spoolLen;
+          writeAllToTmpFile(THIS, &iov, 1);
+          THIS->spoolLen = 0;
+     }
+}
+
+/**
+ * Write whatever is left in the spool to the temp file and free the spool
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ */
+static void flushSpool(data_t * THIS)
+{
+     if(THIS->spool)
+     {
+          writeSpool(THIS);
+
+          NPN_MemFree(THIS->spool);
+          THIS->spool = NULL;
+          THIS->spoolLen = 0;
+     }
+}
+
+/**
+ * Write as much of the spool down the pipe to the helper's stdin as the
+ * pipe will take without blocking. If the helper has gone the pipe is
+ * closed and the data thrown away.
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ *
+ * @return false if the pipe has been closed
+ */
+static bool writeSpoolToStdin(data_t * THIS)
+{
+     int done = 0;
+
+     while(done < THIS->spoolLen)
+     {
+          const ssize_t ret = write(THIS->stdinFd, &THIS->spool[done],
+                                                       THIS->spoolLen - done);
+          if(ret < 0)
+          {
+               if(errno == EINTR)
+               {
+                    continue;
+               }
+               if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+               {
+                    break;
+               }
+               D("Writing to helper's stdin failed\n");
+               close(THIS->stdinFd);
+               THIS->stdinFd = -1;
+               THIS->spoolLen = 0;
+               return false;
+          }
+          done += ret;
+          THIS->tmpFileSize += ret;
+     }
+
+     memmove(THIS->spool, &THIS->spool[done], THIS->spoolLen - done);
+     THIS->spoolLen -= done;
+     return true;
+}
+
+/**
+ * Pass data from the browser down the pipe to the helper's stdin, what the
+ * pipe will not take now is kept in the spool.
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ * @param[in] buf The data
+ * @param[in] len The amount of data
+ *
+ * @return The amount of data taken or -1 if the helper has gone
+ */
+static int32_t pipeData(data_t * THIS, char * buf, int32_t len)
+{
+     if(!writeSpoolToStdin(THIS))
+     {
+          return -1;
+     }
+
+     /* Take no more than the spool can hold */
+     if(len > SPOOL_SIZE - THIS->spoolLen)
+     {
+          len = SPOOL_SIZE - THIS->spoolLen;
+     }
+
+     memcpy(&THIS->spool[THIS->spoolLen], buf, len);
+     THIS->spoolLen += len;
+
+     return writeSpoolToStdin(THIS) ? len : -1;
+}
+
+/**
+ * Close the pipe to the helper's stdin at the end of the stream. Whatever
+ * the helper has not read yet is handed to a child process to write, so
+ * the browser never waits for the helper. The helper sees the end of the
+ * data once the child is done.
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ */
+static void closeStdin(data_t * THIS)
+{
+     if(writeSpoolToStdin(THIS) && (THIS->spoolLen > 0))
+     {
+          pid_t pid;
+
+          D("Forking to write last %i bytes to helper\n", THIS->spoolLen);
+          pid = fork();
+          if(pid == -1)
+          {
+               D("Failed to fork\n");
+          }
+          else if(pid == 0)
+          {
+               /* Fork again so the browser has nothing to reap */
+               if(fork() == 0)
+               {
+                    const int maxFds = sysconf(_SC_OPEN_MAX);
+                    int i;
+
+                    close_debug();
+                    for(i = 3; i < maxFds; i++)
+                    {
+                         if(i != THIS->stdinFd)
+                         {
+                              close(i);
+                         }
+                    }
+
+                    fcntl(THIS->stdinFd, F_SETFL, 0);
+                    writeSpoolToStdin(THIS);
+               }
+               _exit(EXIT_SUCCESS);
+          }
+          else
+          {
+               int status;
+               waitpid(pid, &status, 0);
+
+               THIS->tmpFileSize += THIS->spoolLen;
+          }
+     }
+
+     if(THIS->stdinFd >= 0)
+     {
+          close(THIS->stdinFd);
+          THIS->stdinFd = -1;
+     }
+
+     NPN_MemFree(THIS->spool);
+     THIS->spool = NULL;
+     THIS->spoolLen = 0;
+}
+
+/**
+ * Send progress message to helper if more of the file has been written
+ * since the last one and at least progressInterval has passed, so that
+ * the helper is not woken for every block of data.
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ */
+static void sendProgressMsgIfDue(data_t * THIS)
+{
+     if(THIS->commsPipeFd >= 0)
+     {
+          struct timeval now;
+          long elapsed;
+
+          gettimeofday(&now, NULL);
+          elapsed = (now.tv_sec - THIS->progressTime.tv_sec) * 1000000L
+                              + (now.tv_usec - THIS->progressTime.tv_usec);
+          if(elapsed >= THIS->progressInterval)
+          {
+               /* A progressive helper reads the file as it grows, so
+                * don't keep it waiting for the spool to fill */
+               if((THIS->command->flags & H_PROGRESSIVE)
+                                                    && (THIS->tmpFileFd >= 0))
+               {
+                    writeSpool(THIS);
+               }
+               if(THIS->tmpFileSize != THIS->progressBytes)
+               {
+                    THIS->progressTime = now;
+                    sendProgressMsg(THIS);
+               }
+          }
+     }
+}
+
+/**
+ * For commands with the progressive flag, start the helper on the temp
+ * file once enough of it has been downloaded rather than waiting for
+ * NPP_DestroyStream.
+ *
+ * @param[in] instance Pointer to the plugin instance data
+ */
+static void startProgressiveChild(NPP instance)
+{
+     data_t * const THIS = instance->pdata;
+
+     if((THIS->command->flags & H_PROGRESSIVE) && (THIS->pid == -1)
+          && (THIS->tmpFileSize + THIS->spoolLen >= THIS->progressiveStart))
+     {
+          D("Starting helper with %i bytes downloaded\n",
+                                         THIS->tmpFileSize + THIS->spoolLen);
+          writeSpool(THIS);
+          new_child(instance, THIS->tmpFileName, 0, -1);
+     }
+}
+
+/**
+ * Work out how much to ask for in NPP_WriteReady from the rate the data
+ * arrives, so that on a fast connection the browser passes the data in
+ * a few large blocks rather than many small ones. The amount is that which
+ * arrives in 1/WRITE_READY_DIVISOR of a second, rounded up to a multiple
+ * of CHUNK_SIZE and no bigger than the spool.
+ *
+ * @param[in] THIS Pointer to the plugin instance data
+ * @param[in] len The amount of data just received
+ */
+static void adaptWriteReady(data_t * THIS, int32_t len)
+{
+     struct timeval now;
+     long elapsed;
+
+     THIS->rateBytes += len;
+
+     gettimeofday(&now, NULL);
+     elapsed = (now.tv_sec - THIS->rateStart.tv_sec) * 1000000L
+                                   + (now.tv_usec - THIS->rateStart.tv_usec);
+     if(elapsed >= WRITE_READY_PERIOD_US)
+     {
+          const double rate = THIS->rateBytes * 1000000.0 / elapsed;
+          double size = rate / WRITE_READY_DIVISOR;
+
+          if(size > SPOOL_SIZE)
+          {
+               size = SPOOL_SIZE;
+          }
+          THIS->writeReady = ((int32_t) size + CHUNK_SIZE - 1)
+                                                 / CHUNK_SIZE * CHUNK_SIZE;
+          if(THIS->writeReady < CHUNK_SIZE)
+          {
+               THIS->writeReady = CHUNK_SIZE;
+          }
+          D("Data rate %.0f bytes/s, WriteReady now %i\n", rate,
+                                                      (int) THIS->writeReady);
+          THIS->rateStart = now;
+          THIS->rateBytes = 0;
      }
 }
 
@@ -2888,6 +5187,7 @@ NPError NPP_DestroyStream(NPP instance, NPStream *stream, NPError reason)
 
      if(THIS->tmpFileFd >= 0)
      {
+          flushSpool(THIS);
           close(THIS->tmpFileFd);
           THIS->tmpFileFd = -1;
 
@@ -2896,12 +5196,17 @@ NPError NPP_DestroyStream(NPP instance, NPStream *stream, NPError reason)
                D("Closing Temporary file \'%s\'\n", THIS->tmpFileName);
                if(THIS->commsPipeFd < 0)   /* is no helper? */
                {
-                    new_child(instance, THIS->tmpFileName, 0);
+                    new_child(instance, THIS->tmpFileName, 0, -1);
                }
           }
 
           sendProgressMsg(THIS);
      }
+     else if(THIS->stdinFd >= 0)
+     {
+          closeStdin(THIS);
+          sendProgressMsg(THIS);
+     }
      return NPERR_NO_ERROR;
 }
 
@@ -2922,6 +5227,11 @@ NPError NP2_Initialize(const char * magic,
      NPError err;
      D("NP_Initialize(%.20s)\n", magic);
 
+     if(!select_cfg(magic))
+     {
+          return NPERR_OUT_OF_MEMORY_ERROR;
+     }
+
      if( (err = NPN_InitFuncTable(nsTable)) == NPERR_NO_ERROR)
      {
           if( (err = NPP_InitFuncTable(pluginFuncs)) == NPERR_NO_ERROR)
@@ -2934,8 +5244,10 @@ NPError NP2_Initialize(const char * magic,
                 }
                 else
                 {
-                     const int free = MAX_STATIC_MEMORY_POOL - staticPoolIdx;
-                     D("Static Pool used=%i, free=%i\n", staticPoolIdx, free);
+                     size_t used, size;
+                     const int numChunks = getStaticMemUsage(&used, &size);
+                     D("Static memory used=%lu, mapped=%lu in %i chunks\n",
+                          (unsigned long) used, (unsigned long) size, numChunks);
                 }
           }
      }
@@ -2944,8 +5256,11 @@ NPError NP2_Initialize(const char * magic,
 
 /**
  * The browser calls this function just before it unloads the plugin from
- * memory. So this function should do any tidy up - in this case nothing is
- * required.
+ * memory. So this function should do any tidy up - in this case release the
+ * plugin group's config and forget everything that refers to it, so that if
+ * the library is not actually unloaded the next NP2_Initialize reads it
+ * afresh. The manifest is shared by all the groups so is kept until the last
+ * group is shut down.
  *
  * @param[in] magic references for this particular plugin type
  *
@@ -2953,10 +5268,68 @@ NPError NP2_Initialize(const char * magic,
  */
 NPError NP2_Shutdown(const char * magic)
 {
+     plugin_cfg_t ** pCfg;
+
      D("NP_Shutdown(%.20s)\n", magic);
+
+     if(!select_cfg(magic))
+     {
+          return NPERR_NO_ERROR;
+     }
+
+     if(g_cfg->cmdsFile)
+     {
+          fclose(g_cfg->cmdsFile);
+     }
+     if(g_cfg->cmdsDb)
+     {
+          munmap(g_cfg->cmdsDb, g_cfg->cmdsDbLen);
+     }
+     freeStaticMem();
+
+     for(pCfg = &g_cfgs; *pCfg != g_cfg; pCfg = &(*pCfg)->next)
+          ;
+     *pCfg = g_cfg->next;
+     free(g_cfg);
+     g_cfg = NULL;
+
+     if(!g_cfgs && g_manifest)
+     {
+          munmap((void *) g_manifest, g_manifest->size);
+          g_manifest = NULL;
+          g_manifestStale = false;
+     }
+
      return NPERR_NO_ERROR;
 }
 
+/**
+ * Create a new instance of the plugin group, the instance is called from
+ * then on through the functions set up by NP2_Initialize() and these find
+ * the group from the instance.
+ *
+ * @param[in] magic references for this particular plugin type
+ * @param[in] pluginType Type of embedded object (mime type)
+ * @param[in] instance Pointer to plugin instance data
+ * @param[in] mode Embedded or not
+ * @param[in] argc The number of associated tag attributes
+ * @param[in] argn Array of attribute names
+ * @param[in] argv Array of attribute values
+ * @param[in] saved Pointer to any previously saved data
+ *
+ * @return Returns error code if a problem
+ */
+NPError NP2_New(const char * magic, NPMIMEType pluginType, NPP instance,
+                              uint16_t mode, int16_t argc, char * argn[],
+                              char * argv[], NPSavedData * saved)
+{
+     if(!select_cfg(magic))
+     {
+          return NPERR_OUT_OF_MEMORY_ERROR;
+     }
+     return NPP_New(pluginType, instance, mode, argc, argn, argv, saved);
+}
+
 /**
  * Called when user as requested to print the webpage that contains a visible
  * plug-in. For mozplugger this is ignored.
@@ -2997,16 +5370,27 @@ int32_t NPP_Write(NPP instance, NPStream *stream, int32_t offset, int32_t len,
 
           if(THIS->tmpFileFd >= 0)   /* is tmp file open? */
           {
-               if(offset != THIS->tmpFileSize)
+               if(offset != THIS->tmpFileSize + THIS->spoolLen)
                {
                    D("Strange, there's a gap?\n");
                }
-               len = write(THIS->tmpFileFd, buf, len);
-               THIS->tmpFileSize += len;
-               D("Temporary file size now=%i\n", THIS->tmpFileSize);
+               len = spoolData(THIS, buf, len);
+               if(len > 0)
+               {
+                    adaptWriteReady(THIS, len);
+                    startProgressiveChild(instance);
+               }
+               D("Temporary file size now=%i (+%i spooled)\n",
+                                        THIS->tmpFileSize, THIS->spoolLen);
+          }
+          else if(THIS->stdinFd >= 0)   /* is helper reading stdin? */
+          {
+               len = pipeData(THIS, buf, len);
+               D("Passed %i bytes to helper (%i spooled)\n", (int) len,
+                                                             THIS->spoolLen);
           }
 
-          sendProgressMsg(THIS);
+          sendProgressMsgIfDue(THIS);
      }
      return len;
 }
@@ -3018,7 +5402,7 @@ int32_t NPP_Write(NPP instance, NPStream *stream, int32_t offset, int32_t len,
  * @param[in] instance Pointer to the plugin instance data
  * @param[in] stream Pointer to the stream data structure
  *
- * @return CHUNK_SIZE or zero
+ * @return Amount of data wanted, which grows with the data rate, or zero
  */
 int32_t NPP_WriteReady(NPP instance, NPStream *stream)
 {
@@ -3031,7 +5415,16 @@ int32_t NPP_WriteReady(NPP instance, NPStream *stream)
 
           if(THIS->tmpFileFd >= 0)  /* is tmp file is open? */
           {
-               size = CHUNK_SIZE;
+               size = THIS->writeReady;
+          }
+          else if(THIS->stdinFd >= 0)  /* is helper reading stdin? */
+          {
+               /* Zero, when the helper is not keeping up, makes the
+                * browser hold the data back and try again later */
+               if(writeSpoolToStdin(THIS))
+               {
+                    size = SPOOL_SIZE - THIS->spoolLen;
+               }
           }
           else
           {
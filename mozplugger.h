@@ -20,7 +20,8 @@
 #ifndef _MOZPLUGGER_H_
 #define _MOZPLUGGER_H_
 
-#define MAX_STATIC_MEMORY_POOL 65536
+/* Size of each chunk of the static memory arena used for the config. */
+#define STATIC_MEMORY_CHUNK_SIZE 65536
 
 /* Maximum size of the buffer used for environment variables. */
 #define ENV_BUFFER_SIZE 16348
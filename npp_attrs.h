@@ -0,0 +1,74 @@
+/**
+ * This file is part of mozplugger a fork of plugger, for list of developers
+ * see the README file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+#ifndef _MOZPLUGGER_NPP_ATTRS_H_
+#define _MOZPLUGGER_NPP_ATTRS_H_
+
+/**
+ * The tag attributes that NPP_New() acts on. This is the single list from
+ * which mknppattrs generates the perfect hash table npp_attrs_tab.h at
+ * build time, so adding an attribute here is all that is needed.
+ */
+#define NPP_ATTR_LIST \
+     NPP_ATTR(LOOP, "loop") \
+     NPP_ATTR(NUMLOOP, "numloop") \
+     NPP_ATTR(PLAYCOUNT, "playcount") \
+     NPP_ATTR(AUTOSTART, "autostart") \
+     NPP_ATTR(AUTOPLAY, "autoplay") \
+     NPP_ATTR(SRC, "src") \
+     NPP_ATTR(DATA, "data") \
+     NPP_ATTR(HREF, "href") \
+     NPP_ATTR(QTSRC, "qtsrc") \
+     NPP_ATTR(FILENAME, "filename") \
+     NPP_ATTR(URL, "url") \
+     NPP_ATTR(LOCATION, "location") \
+     NPP_ATTR(TARGET, "target") \
+     NPP_ATTR(AUTOHREF, "autohref")
+
+#define NPP_ATTR(id, name) NPP_ATTR_##id,
+enum npp_attr_e
+{
+     NPP_ATTR_NONE = -1,
+     NPP_ATTR_LIST
+     NUM_NPP_ATTRS
+};
+#undef NPP_ATTR
+
+/**
+ * Case insensitive hash of the attribute names, FNV-1a started from the
+ * seed that mknppattrs found to be collision free.
+ */
+#define NPP_ATTR_HASH_STEP(hash, c) \
+     (((hash) ^ (unsigned char) tolower((unsigned char) (c))) * 16777619u)
+
+/**
+ * The low bits of FNV only depend on the low bits of the input, so fold in
+ * the high bits before taking the slot.
+ */
+#define NPP_ATTR_SLOT(hash, mask) (((hash) ^ ((hash) >> 16)) & (mask))
+
+struct npp_attr_slot_s
+{
+     const char * name;        /**< Attribute name, NULL if slot is empty */
+     int id;                   /**< NPP_ATTR_xxx */
+};
+
+typedef struct npp_attr_slot_s npp_attr_slot_t;
+
+#endif
@@ -24,6 +24,7 @@
 #include <stdio.h>
 
 #include "npapi.h"
+#include "npp_func_tab.h"
 #include "np_funcs.h"
 #include "plugin_entry.h"
 #include "plugin_name.h"
@@ -37,6 +38,27 @@
  */
 static char magic[MAX_PLUGIN_MAGIC_LEN] = PLACE_HOLDER_STR;
 
+/**
+ * Called from browser to create an instance, passes on the magic so that
+ * the instance is of this plugin type even if the code is shared with
+ * others (see plugin_stub.c)
+ *
+ * @param[in] pluginType Type of embedded object (mime type)
+ * @param[in] instance Pointer to plugin instance data
+ * @param[in] mode Embedded or not
+ * @param[in] argc The number of associated tag attributes
+ * @param[in] argn Array of attribute names
+ * @param[in] argv Array of attribute values
+ * @param[in] saved Pointer to any previously saved data
+ *
+ * @return status
+ */
+static NPError new_instance(NPMIMEType pluginType, NPP instance, uint16_t mode,
+                int16_t argc, char * argn[], char * argv[], NPSavedData * saved)
+{
+    return NP2_New(magic, pluginType, instance, mode, argc, argn, argv, saved);
+}
+
 /**
  * Entry point called from browser
  *
@@ -48,7 +70,12 @@ static char magic[MAX_PLUGIN_MAGIC_LEN] = PLACE_HOLDER_STR;
 NPError NP_Initialize(struct NPNetscapeFuncs_s * nsTable,
                                             struct NPPluginFuncs_s * pluginFuncs)
 {
-    return NP2_Initialize(magic, nsTable, pluginFuncs);
+    NPError err = NP2_Initialize(magic, nsTable, pluginFuncs);
+    if(err == NPERR_NO_ERROR)
+    {
+        pluginFuncs->newp = new_instance;
+    }
+    return err;
 }
 
 /**
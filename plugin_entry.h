@@ -34,6 +34,10 @@ NP_EXPORT(const char *) NP2_GetMIMEDescription(const char * magic);
 
 NP_EXPORT(NPError) NP2_Shutdown(const char * magic);
 
+NP_EXPORT(NPError) NP2_New(const char * magic, NPMIMEType pluginType,
+                             NPP instance, uint16_t mode, int16_t argc,
+                             char * argn[], char * argv[], NPSavedData * saved);
+
 NP_EXPORT(const char *) NP2_GetPluginVersion(const char * magic);
 
 #endif
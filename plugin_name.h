@@ -24,4 +24,9 @@
 
 #define PLACE_HOLDER_STR "-1:MaGiC sTrInG"
 
+/* The path of the core mozplugger.so that the stub plugins load */
+#define MAX_CORE_PATH_LEN (512)
+
+#define CORE_PLACE_HOLDER_STR "-1:CoRe PaTh"
+
 #endif
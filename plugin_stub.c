@@ -0,0 +1,305 @@
+/**
+ * This file is part of mozplugger a fork of plugger, for list of developers
+ * see the README file.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA 02111, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dlfcn.h>
+
+#include "npapi.h"
+#include "np_funcs.h"
+#include "plugin_entry.h"
+#include "plugin_name.h"
+
+/**
+ * The stub plugin is plugin_entry.c linked with this file in place of the
+ * rest of mozplugger. mozplugger-update installs a copy of the stub for
+ * each plugin group with the magic and the path of the core mozplugger.so
+ * put in, so however many plugin groups there are the browser only maps
+ * the one copy of the plugin's code. The core is loaded the first time it
+ * is needed and the calls are passed on with the magic of the stub. If it
+ * was only loaded to answer the browser's questions during a plugin scan it
+ * is unloaded again straight after, so an updated core is picked up.
+ */
+static char corePath[MAX_CORE_PATH_LEN] = CORE_PLACE_HOLDER_STR;
+
+typedef NPError (*initialize_t)(const char * magic,
+                                     const struct NPNetscapeFuncs_s * nsTable,
+                                          struct NPPluginFuncs_s * pluginFuncs);
+typedef NPError (*getValue_t)(const char * magic, NPPVariable variable,
+                                                                 void * value);
+typedef const char * (*getString_t)(const char * magic);
+typedef NPError (*shutdown_t)(const char * magic);
+typedef NPError (*new_t)(const char * magic, NPMIMEType pluginType,
+                             NPP instance, uint16_t mode, int16_t argc,
+                             char * argn[], char * argv[], NPSavedData * saved);
+
+/**
+ * The entry points of the core
+ */
+typedef struct core
+{
+     void * handle;
+     initialize_t initialize;
+     getValue_t getValue;
+     getString_t getMIMEDescription;
+     getString_t getPluginVersion;
+     shutdown_t shutdown;
+     new_t newp;
+     bool initialised;  /**< NP2_Initialize succeeded, wait for shutdown */
+} core_t;
+
+static core_t g_core;
+
+static char * g_name = NULL;        /**< Copies of the answers, which */
+static char * g_description = NULL; /**< would point into the core */
+static char * g_version = NULL;
+
+/**
+ * Load the core mozplugger.so if not already loaded
+ *
+ * @return true if loaded
+ */
+static bool load_core(void)
+{
+     void * handle;
+
+     if(g_core.handle)
+     {
+          return true;
+     }
+
+     if((handle = dlopen(corePath, RTLD_NOW | RTLD_LOCAL)) == NULL)
+     {
+          fprintf(stderr, "MozPlugger: %s\n", dlerror());
+          return false;
+     }
+
+     g_core.initialize = (initialize_t) dlsym(handle, "NP2_Initialize");
+     g_core.getValue = (getValue_t) dlsym(handle, "NP2_GetValue");
+     g_core.getMIMEDescription = (getString_t) dlsym(handle, "NP2_GetMIMEDescription");
+     g_core.getPluginVersion = (getString_t) dlsym(handle, "NP2_GetPluginVersion");
+     g_core.shutdown = (shutdown_t) dlsym(handle, "NP2_Shutdown");
+     g_core.newp = (new_t) dlsym(handle, "NP2_New");
+
+     if(!g_core.initialize || !g_core.getValue || !g_core.getMIMEDescription
+          || !g_core.getPluginVersion || !g_core.shutdown || !g_core.newp)
+     {
+          fprintf(stderr, "MozPlugger: '%s' is not a mozplugger core\n", corePath);
+          dlclose(handle);
+          return false;
+     }
+     g_core.handle = handle;
+     return true;
+}
+
+/**
+ * Unload the core if it was only loaded to answer a query
+ *
+ * @param[in] magic references for this particular plugin type
+ */
+static void release_core(const char * magic)
+{
+     if(g_core.handle && !g_core.initialised)
+     {
+          g_core.shutdown(magic);
+          dlclose(g_core.handle);
+          g_core.handle = NULL;
+     }
+}
+
+/**
+ * Keep a copy of a string from the core so it is still there when the core
+ * has been unloaded
+ *
+ * @param[in,out] store Where the copy is kept, the previous copy is freed
+ * @param[in] str The string
+ *
+ * @return The copy
+ */
+static const char * keep_string(char ** store, const char * str)
+{
+     free(*store);
+     *store = str ? strdup(str) : NULL;
+     return *store;
+}
+
+/**
+ * Load the core and initialise the plugin group in it
+ *
+ * @param[in] magic references for this particular plugin type
+ * @param[in] nsTable The table of NPN functions
+ * @param[out] pluginFuncs On return contains the NPP functions
+ *
+ * @return Returns error code if a problem
+ */
+NPError NP2_Initialize(const char * magic,
+                                     const struct NPNetscapeFuncs_s * nsTable,
+                                          struct NPPluginFuncs_s * pluginFuncs)
+{
+     NPError err;
+
+     if(!load_core())
+     {
+          return NPERR_MODULE_LOAD_FAILED_ERROR;
+     }
+
+     err = g_core.initialize(magic, nsTable, pluginFuncs);
+     if(err == NPERR_NO_ERROR)
+     {
+          g_core.initialised = true;
+     }
+     else
+     {
+          /* The browser won't call NP_Shutdown */
+          release_core(magic);
+     }
+     return err;
+}
+
+/**
+ * Get the name or description of the plugin group from the core
+ *
+ * @param[in] magic references for this particular plugin type
+ * @param[in] variable The enumerated name of the variable
+ * @param[out] value Place to put the answer
+ *
+ * @return Returns error code if a problem
+ */
+NPError NP2_GetValue(const char * magic, NPPVariable variable, void *value)
+{
+     NPError err;
+
+     if(!load_core())
+     {
+          return NPERR_MODULE_LOAD_FAILED_ERROR;
+     }
+
+     err = g_core.getValue(magic, variable, value);
+     if(err == NPERR_NO_ERROR)
+     {
+          if(variable == NPPVpluginNameString)
+          {
+               *((const char **) value) = keep_string(&g_name,
+                                                   *((const char **) value));
+          }
+          else if(variable == NPPVpluginDescriptionString)
+          {
+               *((const char **) value) = keep_string(&g_description,
+                                                   *((const char **) value));
+          }
+     }
+     release_core(magic);
+     return err;
+}
+
+/**
+ * Get the mimetypes of the plugin group from the core, if the core cannot
+ * be loaded a dummy mimetype tells the user what is wrong.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return Pointer to string containing mime decription for this plugin
+ */
+const char * NP2_GetMIMEDescription(const char * magic)
+{
+     const char * desc;
+
+     if(!load_core())
+     {
+          return "dummy/dummy:*.dummy:Mozplugger error - failed to load core, "
+                                               "please run mozplugger-update";
+     }
+
+     /* The core allocates the description, so it outlives the core */
+     desc = g_core.getMIMEDescription(magic);
+     release_core(magic);
+     return desc;
+}
+
+/**
+ * Get the version of the plugin group from the core
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return Pointer to the version string
+ */
+const char * NP2_GetPluginVersion(const char * magic)
+{
+     const char * version;
+
+     if(!load_core())
+     {
+          return VERSION;
+     }
+
+     version = keep_string(&g_version, g_core.getPluginVersion(magic));
+     release_core(magic);
+     return version;
+}
+
+/**
+ * Create a new instance in the core, only called once NP2_Initialize() has
+ * loaded the core.
+ *
+ * @param[in] magic references for this particular plugin type
+ * @param[in] pluginType Type of embedded object (mime type)
+ * @param[in] instance Pointer to plugin instance data
+ * @param[in] mode Embedded or not
+ * @param[in] argc The number of associated tag attributes
+ * @param[in] argn Array of attribute names
+ * @param[in] argv Array of attribute values
+ * @param[in] saved Pointer to any previously saved data
+ *
+ * @return Returns error code if a problem
+ */
+NPError NP2_New(const char * magic, NPMIMEType pluginType,
+                             NPP instance, uint16_t mode, int16_t argc,
+                             char * argn[], char * argv[], NPSavedData * saved)
+{
+     return g_core.newp(magic, pluginType, instance, mode, argc, argn, argv,
+                                                                        saved);
+}
+
+/**
+ * Shut down the plugin group in the core, the core is unloaded when it is
+ * no longer used by any of the stubs.
+ *
+ * @param[in] magic references for this particular plugin type
+ *
+ * @return Returns error code if a problem
+ */
+NPError NP2_Shutdown(const char * magic)
+{
+     NPError err = NPERR_NO_ERROR;
+
+     if(g_core.handle)
+     {
+          err = g_core.shutdown(magic);
+          dlclose(g_core.handle);
+          g_core.handle = NULL;
+          g_core.initialised = false;
+     }
+     return err;
+}